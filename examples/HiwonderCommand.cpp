@@ -18,8 +18,12 @@
  */
 
 #include <iostream>
+#include <memory>
 #include <vector>
 #include "HiwonderBusServo.hpp"
+#include "HiwonderBusTiming.hpp"
+#include "HiwonderTeachIn.hpp"
+#include "HiwonderTrack.hpp"
 
 
 // Some raspian OS still don't have C++17 -> no std::optional
@@ -106,7 +110,10 @@ void printHelp()
 	" - set_middle <id>: Set the servo with id=<id> to it middle position (500)\n"
 	" - move <id> <angle>: Set the servo with id=<id> to it position=<angle> in 0s\n"
 	" - read_voltage <id>: Return the input voltage for the servo with id=<id>\n"
-	" - read_position <id>: Return the current position of the servo with id=<id>" << std::endl;
+	" - read_position <id>: Return the current position of the servo with id=<id>\n"
+	" - record <file> <seconds> <id> [<id> ...]: Unload the servos and record their\n"
+	"       positions, moved by hand, into <file>\n"
+	" - play <file>: Replay a track recorded into <file>" << std::endl;
 }
 
 bool checkArguments( int num, int exp, const std::string& name )
@@ -180,6 +187,69 @@ auto main(int num, char* args[]) ->int
 		HiwonderRpi::HiwonderBusServo servo(*idOpt);
 		std::cout << "    " << static_cast<float>(servo.posRead())*0.24f << "º" << std::endl;
 	}
+	else if (command == "record")
+	{
+		if (num < 5)
+		{
+			std::cout << "Error: record command expect at least 3 arguments" << std::endl;
+			printHelp();
+			return 1;
+		}
+		
+		double seconds = 0;
+		try
+		{
+			seconds = std::stod(argsStr[3]);
+		}
+		catch(...)
+		{
+			std::cout << "Error, argument 2 expected to be a duration in seconds" << std::endl;
+			return 1;
+		}
+		
+		std::vector<std::unique_ptr<HiwonderRpi::HiwonderBusServo>> servos;
+		std::vector<HiwonderRpi::TeachInRecorder::ServoRef> refs;
+		for (int i=4; i<num; ++i)
+		{
+			auto idOpt = getServoId(argsStr[i],i-1);
+			if (!idOpt) return 1;
+			servos.push_back(std::make_unique<HiwonderRpi::HiwonderBusServo>(*idOpt));
+			refs.push_back(*servos.back());
+		}
+		
+		HiwonderRpi::TeachInRecorder recorder(refs);
+		recorder.start();
+		std::cout << "    Recording, move the servos by hand..." << std::endl;
+		recorder.record(std::chrono::microseconds(static_cast<int64_t>(seconds*1e6)));
+		recorder.stop();
+		
+		const auto& track = recorder.track();
+		track.save(argsStr[2]);
+		std::cout << "    " << track.frameCount() << " frames recorded ("
+		    << track.frameCount()*1e6/std::max(1u, track.duration()) << " Hz, "
+		    << recorder.failedReads() << " failed reads)" << std::endl;
+	}
+	else if (command == "play")
+	{
+		if (!checkArguments(num, 1, "play")) return 1;
+		
+		const auto track = HiwonderRpi::Track::load(argsStr[2]);
+		
+		std::vector<std::unique_ptr<HiwonderRpi::HiwonderBusServo>> servos;
+		std::vector<HiwonderRpi::TrackPlayer::ServoRef> refs;
+		for (auto id: track.ids)
+		{
+			servos.push_back(std::make_unique<HiwonderRpi::HiwonderBusServo>(id));
+			refs.push_back(*servos.back());
+		}
+		
+		if (refs.empty()) return 0;
+		
+		// Lead each setpoint by the time its frame takes to reach the servo
+		HiwonderRpi::BusTiming timing;
+		timing.measure(refs.front());
+		HiwonderRpi::TrackPlayer(refs, timing).play(track);
+	}
 	else if (command == "demo")
 	{
 		std::cout <<  "Demoing..." <<  std::endl;
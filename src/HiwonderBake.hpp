@@ -0,0 +1,180 @@
+/*
+ * This file is part of HiwonderRPI library
+ *
+ * HiwonderRPI is free software: you can redistribute it and/or modify
+ * it under ther terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HiwonderRPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HiwonderRPI. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Author: Adrian Maire escain (at) gmail.com
+ */
+
+#ifndef HIWONDER_RPI_BAKE
+#define HIWONDER_RPI_BAKE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "HiwonderTrack.hpp"
+
+namespace HiwonderRpi
+{
+
+/// Offline baking of a choreography into a Track: the setpoints of all joints
+///     are computed ahead of time, so playback (TrackPlayer) does no math.
+/// The duration is split into time segments computed in parallel by a pool of
+///     worker threads, each writing its frames in place in the track.
+class TrackBaker
+{
+public:
+	/// Compute the position of every joint (servo units, one per track id)
+	///     at a time in seconds. Called concurrently and out of order: it must
+	///     only depend on the time, and not modify shared state.
+	/// A stateful generator (e.g. a WaypointQueue advanced on each call) needs
+	///     Config::threads = 1: the frames are then computed in time order.
+	using Choreography = std::function<void(double, int16_t*)>;
+
+	struct Config
+	{
+		/// Time between frames
+		std::chrono::microseconds period = std::chrono::microseconds(20000);
+		/// Number of worker threads, 0 for one per core, 1 for time order
+		size_t threads = 0;
+		/// Number of frames in each time segment given to a worker
+		size_t segmentFrames = 256;
+	};
+
+	TrackBaker();
+	TrackBaker( const Config& config );
+
+	/// Bake <choreography> every period from time 0, and at <duration> (the
+	///     last frame, also when <duration> is not a multiple of the period)
+	/// @arg ids: servo ids, one per joint computed by the choreography
+	/// @throw runtime_error if <duration> is negative or does not fit the track
+	///     timestamps (32 bits of microseconds, about 71 minutes)
+	/// @throw whatever the choreography throws (first exception raised)
+	Track bake( const std::vector<uint8_t>& ids, std::chrono::microseconds duration,
+	    const Choreography& choreography ) const;
+
+	/// Number of worker threads actually used
+	size_t threadCount() const;
+
+private:
+	Config m_config;
+};
+
+
+
+
+//*********************************************************
+//                   IMPLEMENTATION
+//*********************************************************
+
+inline TrackBaker::TrackBaker(): m_config(Config())
+{
+}
+
+inline TrackBaker::TrackBaker( const Config& config ): m_config(config)
+{
+	if (m_config.period.count() <= 0 || m_config.segmentFrames == 0)
+	{
+		throw std::runtime_error("TrackBaker: period and segmentFrames must be positive");
+	}
+}
+
+inline size_t TrackBaker::threadCount() const
+{
+	if (m_config.threads) return m_config.threads;
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+inline Track TrackBaker::bake( const std::vector<uint8_t>& ids, std::chrono::microseconds duration,
+    const Choreography& choreography ) const
+{
+	if (duration.count() < 0 || duration.count() > std::numeric_limits<uint32_t>::max())
+	{
+		throw std::runtime_error("TrackBaker: duration out of the track time range");
+	}
+	const auto period = m_config.period.count();
+	const size_t frames = static_cast<size_t>(duration.count()/period) + 1
+	    + (duration.count()%period ? 1 : 0);
+
+	// Allocate the whole track, workers only fill their own frames
+	Track track;
+	track.ids = ids;
+	track.timestamps.resize(frames);
+	track.positions.resize(frames*ids.size());
+
+	const size_t segments = (frames + m_config.segmentFrames - 1)/m_config.segmentFrames;
+	std::atomic<size_t> nextSegment(0);
+	std::atomic<bool> failed(false);
+	std::exception_ptr error;
+	std::mutex errorMutex;
+
+	auto worker = [&]()
+	{
+		try
+		{
+			for (size_t s = nextSegment++; s < segments && !failed; s = nextSegment++)
+			{
+				const size_t begin = s*m_config.segmentFrames;
+				const size_t end = std::min(frames, begin + m_config.segmentFrames);
+				for (size_t f=begin; f<end; ++f)
+				{
+					const auto us = static_cast<uint32_t>(std::min<int64_t>(static_cast<int64_t>(f)*period, duration.count()));
+					track.timestamps[f] = us;
+					choreography(us*1e-6, track.frame(f));
+				}
+			}
+		}
+		catch(...)
+		{
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!error) error = std::current_exception();
+			failed = true;
+		}
+	};
+
+	// The calling thread is one of the workers. When a thread can not be
+	//     started, the ones already running (and this one) share the segments.
+	const size_t workers = std::min(threadCount(), segments);
+	std::vector<std::thread> pool;
+	pool.reserve(workers);
+	for (size_t i=1; i<workers; ++i)
+	{
+		try
+		{
+			pool.emplace_back(worker);
+		}
+		catch(const std::system_error&)
+		{
+			break;
+		}
+	}
+	worker();
+	for (auto& thread: pool) thread.join();
+
+	if (error) std::rethrow_exception(error);
+	return track;
+}
+
+}
+#endif //HIWONDER_RPI_BAKE
@@ -20,10 +20,16 @@
 #ifndef HIWONDER_RPI
 #define HIWONDER_RPI
 
+#include <algorithm>
 #include <array>
+#include <chrono>
 #include <cstdint>
 #include <exception>
 #include <functional>
+#include <stdexcept>
+
+#include <termios.h>
+#include <unistd.h>
 
 #include <wiringPi.h>
 #include <wiringSerial.h>
@@ -46,9 +52,10 @@ constexpr int8_t operator ""_int8( unsigned long long v) { return static_cast<in
 ///     Methods in this class and servo commands match 1 to 1.
 class HiwonderBusServo
 {
+public:
+	/// Frame sent to or received from a servo (the largest frame is 10 bytes)
 	using Buffer = std::array<uint8_t,10>;
 	
-public:
 	struct MoveTime
 	{
 		uint16_t position;
@@ -92,6 +99,24 @@ public:
 		bool stall;
 	};
 	
+	/// Outcome of a request-reply transaction with the servo
+	enum class Transaction: uint8_t
+	{
+		Ok = 0,
+		Timeout = 1,
+		Corrupted = 2
+	};
+	
+	/// Thrown when a reply frame arrives but can not be valid (see readFrame)
+	struct CorruptedFrame: public std::runtime_error
+	{
+		using std::runtime_error::runtime_error;
+	};
+	
+	/// Called after each request-reply, with the servo id, the outcome and
+	///     the time from request to reply in microseconds
+	using TransactionObserver = std::function<void(uint8_t, Transaction, uint32_t)>;
+	
 	/// Constructor, accept the servo ID. 
 	/// Id=254 is the broadcast ID
 	HiwonderBusServo( uint8_t id=254 );
@@ -175,6 +200,15 @@ public:
 	/// Note: the servo can be easily 0.5deg away of it command, that way it can be in negative angle.
 	int16_t posRead() const;
 	
+	/// First half of posRead: send the position request without waiting for the reply.
+	/// Allows to do other work while the request travels and the servo answers.
+	/// Every posReadRequest must be followed by posReadReply before any other bus access.
+	void posReadRequest() const;
+	
+	/// Second half of posRead: wait for and decode the reply of posReadRequest.
+	/// @throw runtime_error on timeout or corrupted reply
+	int16_t posReadReply() const;
+	
 	/// Set (volatile) the mode of the device: Servo or Motor (position or speed)
 	/// In case of motor mode, the speed can be specified: 0=stopped, negative/positive for each direction.
 	/// @arg mode: Servo or Motor
@@ -207,6 +241,47 @@ public:
 	
 	/// Read the LED errors set
 	LedError ledErrorRead() const;
+	
+	/// Return the servo ID this object talks to
+	uint8_t getId() const;
+	
+	/// Set the function called after each read (see TransactionObserver)
+	/// An empty function disables it.
+	void setTransactionObserver( TransactionObserver observer );
+	
+	/// Frame encoding and decoding, without bus access. Used to batch the frames
+	///     of several servos in a single write (see HiwonderRobot.hpp).
+	/// Sizes are in bytes, for the whole frame
+	constexpr static size_t MoveTimeWriteFrameSize = 10;
+	constexpr static size_t ServoOrMotorModeWriteFrameSize = 10;
+	constexpr static size_t PosReadFrameSize = 6;
+	constexpr static size_t PosReplyFrameSize = 8;
+	
+	/// Checksum of a frame (its size is read from the frame)
+	constexpr static uint8_t frameChecksum( const uint8_t* frame );
+	
+	/// Encode moveTimeWrite into <out> (MoveTimeWriteFrameSize bytes)
+	inline static void encodeMoveTimeWrite( uint8_t id, int16_t position, uint16_t time, uint8_t* out );
+	
+	/// Encode servoOrMotorModeWrite into <out> (ServoOrMotorModeWriteFrameSize bytes)
+	inline static void encodeServoOrMotorModeWrite( uint8_t id, Mode mode, int16_t speed, uint8_t* out );
+	
+	/// Encode the request of posRead
+	constexpr static std::array<uint8_t, PosReadFrameSize> encodePosRead( uint8_t id );
+	
+	/// Decode the reply of posRead into <position>
+	/// @return false if the frame is not a valid position reply from servo <id>
+	inline static bool decodePosReply( uint8_t id, const Buffer& frame, int16_t& position );
+	
+	/// Prepare the UART device <fd> for a request: wait until the frames already
+	///     written are sent, then drop stale input. Flushing the output instead
+	///     (serialFlush) would cut the queued commands, possibly mid-frame.
+	inline static void discardInput( int fd );
+	
+	/// Read a reply frame from the UART device <fd> into <frame> (see getMessage)
+	/// @throw CorruptedFrame if the frame size is invalid
+	/// @throw runtime_error if the message does not arrive until timeout
+	inline static void readFrame( int fd, Buffer& frame );
 
 private:
 	
@@ -245,11 +320,36 @@ private:
 	/// @arg buf: Buffer of the request (id, and checksum are computed internally)
 	/// @arg replySize: expected size of the reply (for checks).
 	inline const Buffer& genericRead( Buffer& buf, uint8_t replySize ) const;
+	
+	/// First half of genericRead: set id and checksum, flush input and send the request.
+	inline void genericRequest( Buffer& buf ) const;
+	
+	/// Second half of genericRead: read the reply and check its validity.
+	/// @arg commandId: command of the request, expected in the reply
+	/// @arg replySize: expected size of the reply (for checks).
+	inline const Buffer& genericReply( uint8_t commandId, uint8_t replySize ) const;
+	
+	/// Call the transaction observer, if any, for the current request
+	inline void notifyTransaction( Transaction transaction ) const;
+	
+	/// Write commands shared with the frame encoders
+	constexpr static uint8_t MoveTimeWriteId = 1;
+	constexpr static uint8_t MoveTimeWriteSize = 7;
+	constexpr static uint8_t ServoOrMotorModeWriteId = 29;
+	constexpr static uint8_t ServoOrMotorModeWriteSize = 7;
+	
+	/// Position read command, shared by posRead, posReadRequest and posReadReply
+	constexpr static uint8_t PosReadId = 28;
+	constexpr static uint8_t PosReadSize = 3;
+	constexpr static uint8_t PosReplySize = 5;
 
 	// Access to the device
 	int fd = -1;
 	// Id of the servo
 	int id = 1;
+	// Transaction observer, and time the current request was sent
+	TransactionObserver observer;
+	mutable std::chrono::steady_clock::time_point requestTime;
 };
 
 
@@ -270,28 +370,105 @@ uint8_t HiwonderBusServo::getHighByte( const uint16_t in)
 }
 
 uint8_t HiwonderBusServo::checksum(const Buffer& buf)
+{
+	return frameChecksum(buf.data());
+}
+
+constexpr uint8_t HiwonderBusServo::frameChecksum( const uint8_t* frame )
 {
 	uint16_t temp = 0;
-	for (size_t i=2; i<buf[3]+2u; ++i)
+	for (size_t i=2; i<frame[3]+2u; ++i)
 	{
-		temp += buf[i];
+		temp += frame[i];
 	}
 	temp = ~temp;
-	return getLowByte(temp);
+	return static_cast<uint8_t>(temp);
+}
+
+void HiwonderBusServo::encodeMoveTimeWrite( uint8_t id, int16_t position, uint16_t time, uint8_t* out )
+{
+	if (position<0) position=0;
+	if (position>1000) position=1000;
+	
+	out[0] = FrameHeader;
+	out[1] = FrameHeader;
+	out[2] = id;
+	out[3] = MoveTimeWriteSize;
+	out[4] = MoveTimeWriteId;
+	out[5] = getLowByte(position);
+	out[6] = getHighByte(position);
+	out[7] = getLowByte(time);
+	out[8] = getHighByte(time);
+	out[9] = frameChecksum(out);
+}
+
+void HiwonderBusServo::encodeServoOrMotorModeWrite( uint8_t id, Mode mode, int16_t speed, uint8_t* out )
+{
+	speed = std::max(speed,static_cast<int16_t>(-1000));
+	speed = std::min(speed,1000_int16);
+	
+	out[0] = FrameHeader;
+	out[1] = FrameHeader;
+	out[2] = id;
+	out[3] = ServoOrMotorModeWriteSize;
+	out[4] = ServoOrMotorModeWriteId;
+	out[5] = static_cast<uint8_t>(mode);
+	out[6] = 0_uint8;
+	out[7] = getLowByte(speed);
+	out[8] = getHighByte(speed);
+	out[9] = frameChecksum(out);
+}
+
+constexpr std::array<uint8_t, HiwonderBusServo::PosReadFrameSize> HiwonderBusServo::encodePosRead( uint8_t id )
+{
+	std::array<uint8_t, PosReadFrameSize> frame
+	{
+		FrameHeader,
+		FrameHeader,
+		id,
+		PosReadSize,
+		PosReadId,
+		_pholder
+	};
+	frame[5] = frameChecksum(frame.data());
+	return frame;
+}
+
+bool HiwonderBusServo::decodePosReply( uint8_t id, const Buffer& frame, int16_t& position )
+{
+	if (!checkMessage(frame, PosReadId, PosReplySize) || frame[2] != id)
+	{
+		return false;
+	}
+	position = frame[5]+(frame[6]<<8);
+	return true;
 }
 
 void HiwonderBusServo::sendBuf(const Buffer& buf) const
 {
-	for (size_t i=0; i< buf[3]+3u; ++i)
+	// Single write for the whole frame: one syscall instead of one per byte
+	const size_t size = buf[3]+3u;
+	if (::write(fd, buf.data(), size) != static_cast<ssize_t>(size))
 	{
-		serialPutchar(fd, buf[i]);
+		throw std::runtime_error("Unable to send message to servo");
 	}
 }
 	
+void HiwonderBusServo::discardInput( int fd )
+{
+	tcdrain(fd);
+	tcflush(fd, TCIFLUSH);
+}
+
 const HiwonderBusServo::Buffer& HiwonderBusServo::getMessage() const
 {
 	static Buffer res;
-	
+	readFrame(fd, res);
+	return res;
+}
+
+void HiwonderBusServo::readFrame( int fd, Buffer& res )
+{
 	constexpr static size_t MaxBusyLoop = 20000;
 	
 	// To avoid timeout (too long), poll until we get enough bytes
@@ -302,7 +479,6 @@ const HiwonderBusServo::Buffer& HiwonderBusServo::getMessage() const
 	{
 		res[3]=res[2]=0;
 		throw std::runtime_error("Unable to retrieve message header from servo");
-		return res;
 	}
 	
 	res[0] = serialGetchar(fd); //frame header 1
@@ -310,21 +486,25 @@ const HiwonderBusServo::Buffer& HiwonderBusServo::getMessage() const
 	res[2] = serialGetchar(fd); //servo id
 	res[3] = serialGetchar(fd); //size
 	
+	// A size over the buffer can only be a corrupted frame
+	if (res[3] < 2 || res[3] > res.size()-3)
+	{
+		res[3]=res[2]=0;
+		throw CorruptedFrame("Corrupted message size received from servo");
+	}
+	
 	for(size_t i=0; i<MaxBusyLoop && serialDataAvail(fd)<res[3]-1; ++i) continue; //noop
 	
 	if (serialDataAvail(fd)<res[3]-1)
 	{
 		res[3]=res[2]=0;
 		throw std::runtime_error("Unable to retrieve message content from servo");
-		return res;
 	}
 	
 	for (size_t i=0; i<res[3]-1u; ++i)
 	{
 		res[i+4] = serialGetchar(fd);
 	}
-	
-	return res;
 }
 	
 	
@@ -355,53 +535,70 @@ HiwonderBusServo::~HiwonderBusServo()
 }
 
 const HiwonderBusServo::Buffer& HiwonderBusServo::genericRead( Buffer& buf, uint8_t replySize ) const
+{
+	genericRequest(buf);
+	return genericReply(buf[4], replySize);
+}
+
+void HiwonderBusServo::genericRequest( Buffer& buf ) const
 {
 	buf[2] = id;
 	buf[buf[3]+2] = checksum(buf);
 	
-	serialFlush(fd);
+	discardInput(fd);
+	if (observer) requestTime = std::chrono::steady_clock::now();
 	sendBuf(buf);
-	
+}
+
+const HiwonderBusServo::Buffer& HiwonderBusServo::genericReply( uint8_t commandId, uint8_t replySize ) const
+{
 	// Read result
-	const Buffer& res= getMessage();
+	const Buffer* res = nullptr;
+	try
+	{
+		res = &getMessage();
+	}
+	catch(const CorruptedFrame&)
+	{
+		notifyTransaction(Transaction::Corrupted);
+		throw;
+	}
+	catch(const std::runtime_error&)
+	{
+		notifyTransaction(Transaction::Timeout);
+		throw;
+	}
 	
-	if (!checkMessage(res, buf[4], replySize))
+	if (!checkMessage(*res, commandId, replySize))
 	{
+		notifyTransaction(Transaction::Corrupted);
 		throw std::runtime_error("Corrupted message received");
 	}
 	
-	return res;
+	// A late reply of another servo must not be taken for ours (broadcast accepts any)
+	if (id != 254 && (*res)[2] != id)
+	{
+		notifyTransaction(Transaction::Corrupted);
+		throw std::runtime_error("Reply received from an unexpected servo");
+	}
+	
+	notifyTransaction(Transaction::Ok);
+	return *res;
 }
 
-void HiwonderBusServo::moveTimeWrite( int16_t position, uint16_t time)
+void HiwonderBusServo::notifyTransaction( Transaction transaction ) const
 {
-	constexpr static uint8_t MoveTimeWriteId = 1;
-	constexpr static uint8_t MoveTimeWriteSize = 7;
-	
-	static Buffer buf
-	{
-		FrameHeader, 
-		FrameHeader,
-		_pholder,
-		MoveTimeWriteSize,
-		MoveTimeWriteId,
-		_pholder,
-		_pholder,
-		_pholder,
-		_pholder,
-		_pholder
-	};
-	
-	if (position<0) position=0;
-	if (position>1000) position=1000;
-	
-	buf[2] = id;
-	buf[5] = getLowByte(position);
-	buf[6] = getHighByte(position);
-	buf[7] = getLowByte(time);
-	buf[8] = getHighByte(time);
-	buf[9] = checksum(buf);
+	if (!observer) return;
 	
+	const auto latency = std::chrono::steady_clock::now() - requestTime;
+	observer(static_cast<uint8_t>(id), transaction,
+	    static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count()));
+}
+
+void HiwonderBusServo::moveTimeWrite( int16_t position, uint16_t time)
+{
+	static Buffer buf;
+	encodeMoveTimeWrite(id, position, time, buf.data());
 	sendBuf(buf);
 }
 
@@ -565,7 +762,7 @@ uint8_t HiwonderBusServo::idRead() const
 	buf[2] = 254;
 	buf[buf[3]+2] = checksum(buf);
 	
-	serialFlush(fd);
+	discardInput(fd);
 	sendBuf(buf);
 	
 	// Read result
@@ -850,54 +1047,36 @@ uint16_t HiwonderBusServo::vinRead() const
 
 int16_t HiwonderBusServo::posRead() const
 {
-	constexpr static uint8_t posReadId = 28;
-	constexpr static uint8_t posReadSize = 3;
-	constexpr static uint8_t posReplySize = 5;
-	
+	posReadRequest();
+	return posReadReply();
+}
+
+void HiwonderBusServo::posReadRequest() const
+{
 	static Buffer buf
 	{
 		FrameHeader, 
 		FrameHeader,
 		_pholder,
-		posReadSize,
-		posReadId,
+		PosReadSize,
+		PosReadId,
 		_pholder
 	};
 	
-	const Buffer& resultBuf = genericRead(buf, posReplySize);
+	genericRequest(buf);
+}
+
+int16_t HiwonderBusServo::posReadReply() const
+{
+	const Buffer& resultBuf = genericReply(PosReadId, PosReplySize);
 	
 	return resultBuf[5]+(resultBuf[6]<<8);
 }
 
 void HiwonderBusServo::servoOrMotorModeWrite( Mode mode, int16_t speed )
 {
-	constexpr static uint8_t ServoOrMotorModeWriteId = 29;
-	constexpr static uint8_t ServoOrMotorModeWriteSize = 7;
-	
-	static Buffer buf
-	{
-		FrameHeader, 
-		FrameHeader,
-		_pholder,
-		ServoOrMotorModeWriteSize,
-		ServoOrMotorModeWriteId,
-		_pholder,
-		_pholder,
-		_pholder,
-		_pholder,
-		_pholder
-	};
-	
-	speed = std::max(speed,static_cast<int16_t>(-1000));
-	speed = std::min(speed,1000_int16);
-	
-	buf[2] = id;
-	buf[5] = static_cast<uint8_t>(mode);
-	buf[6] = 0_uint8;
-	buf[7] = getLowByte(speed);
-	buf[8] = getHighByte(speed);
-	buf[9] = checksum(buf);
-	
+	static Buffer buf;
+	encodeServoOrMotorModeWrite(id, mode, speed, buf.data());
 	sendBuf(buf);
 }
 	
@@ -1061,6 +1240,16 @@ HiwonderBusServo::LedError HiwonderBusServo::ledErrorRead() const
 	return result;
 }
 
+uint8_t HiwonderBusServo::getId() const
+{
+	return static_cast<uint8_t>(id);
+}
+
+void HiwonderBusServo::setTransactionObserver( TransactionObserver newObserver )
+{
+	observer = std::move(newObserver);
+}
+
 }
 #endif //HIWONDER_RPI
 
@@ -0,0 +1,144 @@
+/*
+ * This file is part of HiwonderRPI library
+ *
+ * HiwonderRPI is free software: you can redistribute it and/or modify
+ * it under ther terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HiwonderRPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HiwonderRPI. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Author: Adrian Maire escain (at) gmail.com
+ */
+
+#ifndef HIWONDER_RPI_BUS_TIMING
+#define HIWONDER_RPI_BUS_TIMING
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+#include "HiwonderBusServo.hpp"
+
+namespace HiwonderRpi
+{
+
+/// Timing of the UART link: when does a command sent now take effect.
+/// A setpoint takes effect once the last byte of its frame reaches the servo,
+///     plus the link latency (UART driver, half-duplex adapter, servo processing).
+///     In a burst of frames sent back to back, frame <i> takes effect after
+///     i+1 frames are transmitted: streaming layers use effectDelayUs to sample
+///     their trajectory at that time instead of at the tick time.
+class BusTiming
+{
+public:
+	/// Frame sizes in bytes (header, id, length, command, parameters, checksum)
+	constexpr static size_t MoveTimeWriteFrame = HiwonderBusServo::MoveTimeWriteFrameSize;
+	constexpr static size_t PosReadRequestFrame = HiwonderBusServo::PosReadFrameSize;
+	constexpr static size_t PosReadReplyFrame = HiwonderBusServo::PosReplyFrameSize;
+
+	/// @arg baudRate: UART speed, with 10 bits per byte (8N1)
+	BusTiming( uint32_t baudRate = 115200 );
+
+	/// Time to transmit <bytes>, in microseconds
+	double transmitUs( size_t bytes ) const;
+
+	/// Delay from the start of a burst to the moment its frame <index> takes effect, in microseconds
+	/// @arg index: position of the frame in the burst (0 for the first one)
+	/// @arg frameSize: size of each frame of the burst
+	double effectDelayUs( size_t index, size_t frameSize = MoveTimeWriteFrame ) const;
+
+	/// One-way link latency, in microseconds
+	double linkLatencyUs() const;
+	void setLinkLatencyUs( double latencyUs );
+
+	/// Account a measured request-reply time: the one-way latency is half of what
+	///     is not explained by the transmission of both frames (running average)
+	void addRoundTrip( double roundTripUs, size_t requestBytes = PosReadRequestFrame,
+	    size_t replyBytes = PosReadReplyFrame );
+
+	/// Measure the link latency by timing <samples> position reads of <servo>
+	/// Failed reads are ignored.
+	void measure( HiwonderBusServo& servo, size_t samples = 20 );
+
+private:
+	double m_byteUs;
+	double m_latencyUs = 0.0;
+	size_t m_roundTrips = 0;
+};
+
+
+
+
+//*********************************************************
+//                   IMPLEMENTATION
+//*********************************************************
+
+inline BusTiming::BusTiming( uint32_t baudRate )
+{
+	if (baudRate == 0)
+	{
+		throw std::runtime_error("BusTiming: baud rate must be positive");
+	}
+	m_byteUs = 10.0*1e6/baudRate;
+}
+
+inline double BusTiming::transmitUs( size_t bytes ) const
+{
+	return bytes*m_byteUs;
+}
+
+inline double BusTiming::effectDelayUs( size_t index, size_t frameSize ) const
+{
+	return transmitUs((index+1)*frameSize) + m_latencyUs;
+}
+
+inline double BusTiming::linkLatencyUs() const
+{
+	return m_latencyUs;
+}
+
+inline void BusTiming::setLinkLatencyUs( double latencyUs )
+{
+	m_latencyUs = latencyUs;
+	m_roundTrips = 0;
+}
+
+inline void BusTiming::addRoundTrip( double roundTripUs, size_t requestBytes, size_t replyBytes )
+{
+	const double latency = std::max(0.0, (roundTripUs - transmitUs(requestBytes + replyBytes))/2.0);
+
+	// Plain mean for the first samples, then a slow running average
+	++m_roundTrips;
+	const double weight = std::max(1.0/m_roundTrips, 0.05);
+	m_latencyUs += weight*(latency - m_latencyUs);
+}
+
+inline void BusTiming::measure( HiwonderBusServo& servo, size_t samples )
+{
+	using Clock = std::chrono::steady_clock;
+	for (size_t i=0; i<samples; ++i)
+	{
+		const auto start = Clock::now();
+		try
+		{
+			servo.posRead();
+		}
+		catch(const std::runtime_error&)
+		{
+			continue;
+		}
+		addRoundTrip(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+	}
+}
+
+}
+#endif //HIWONDER_RPI_BUS_TIMING
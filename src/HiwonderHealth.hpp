@@ -0,0 +1,472 @@
+/*
+ * This file is part of HiwonderRPI library
+ *
+ * HiwonderRPI is free software: you can redistribute it and/or modify
+ * it under ther terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HiwonderRPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HiwonderRPI. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Author: Adrian Maire escain (at) gmail.com
+ */
+
+#ifndef HIWONDER_RPI_HEALTH
+#define HIWONDER_RPI_HEALTH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "HiwonderBusServo.hpp"
+
+namespace HiwonderRpi
+{
+
+/// Per-servo health: aggregates the bus signals of each servo id (reply latency,
+///     timeout and corrupted reply rates, temperature and voltage headroom,
+///     tracking error) into a score in [0,100], 100 being a perfectly healthy servo.
+/// A summary of each run is kept in a history, that can be persisted across runs
+///     to follow the degradation trend of each servo.
+class HealthMonitor
+{
+public:
+	/// Thresholds of the score: each signal starts to cost points past its threshold
+	struct Config
+	{
+		/// Reply latency considered normal, in microseconds
+		float nominalLatencyUs = 2000.0f;
+		/// Temperature headroom (to tempMaxLimit) below which the score decreases, in deg celsius
+		float minTempHeadroom = 15.0f;
+		/// Voltage headroom (to the closest vinLimit) below which the score decreases, in mV
+		float minVinHeadroom = 500.0f;
+		/// Tracking error considered normal, in position units
+		float nominalTrackingError = 10.0f;
+		/// Failure rate (timeouts + corrupted) above which a servo is flaky
+		float flakyFailureRate = 0.02f;
+		/// Weight of a new value in the running averages
+		float averageWeight = 0.05f;
+	};
+
+	/// Signals of one servo during the current run
+	struct Stats
+	{
+		uint32_t transactions = 0;
+		uint32_t timeouts = 0;
+		uint32_t corrupted = 0;
+		/// Running average of the reply latency, in microseconds
+		float latencyUs = NAN;
+		/// Distance to the temperature and voltage limits (NAN until sampled)
+		float tempHeadroom = NAN;
+		float vinHeadroom = NAN;
+		/// Running average of the tracking error, in position units
+		float trackingError = NAN;
+
+		float timeoutRate() const;
+		float corruptedRate() const;
+	};
+
+	/// Summary of one servo for one run, as kept in the history
+	struct Record
+	{
+		uint8_t id = 0;
+		uint32_t run = 0;
+		float score = 100.0f;
+		float latencyUs = NAN;
+		float timeoutRate = 0.0f;
+		float corruptedRate = 0.0f;
+		float tempHeadroom = NAN;
+		float vinHeadroom = NAN;
+		float trackingError = NAN;
+	};
+
+	/// Evolution per run, from a least-squares fit over the history and the current run
+	struct Trend
+	{
+		float scorePerRun = 0.0f;
+		float latencyUsPerRun = 0.0f;
+	};
+
+	HealthMonitor();
+	HealthMonitor( const Config& config );
+	/// Monitor object can not be copied nor moved (attached servos refer to it)
+	HealthMonitor( const HealthMonitor& ) = delete;
+	HealthMonitor& operator=( const HealthMonitor& ) = delete;
+
+	/// Observe every transaction of the servo. The monitor must outlive the
+	///     servo, or be detached before being destroyed.
+	void attach( HiwonderBusServo& servo );
+	void detach( HiwonderBusServo& servo );
+
+	/// Account for a transaction (called by the servos once attached)
+	void onTransaction( uint8_t id, HiwonderBusServo::Transaction transaction, uint32_t latencyUs );
+
+	/// Read temperature, voltage and tracking error (target versus position) of a servo.
+	/// The tracking error is only meaningful while the servo is not moving: during
+	///     motions, use reportTrackingError with the error against the trajectory.
+	/// Limits are read once per servo. Failed reads are skipped (and counted).
+	void sample( HiwonderBusServo& servo );
+
+	/// Account for the tracking error of a servo, in position units
+	void reportTrackingError( uint8_t id, float error );
+
+	/// Signals of a servo for the current run
+	const Stats& stats( uint8_t id ) const;
+
+	/// Health score of a servo, in [0,100]
+	float score( uint8_t id ) const;
+
+	/// Trend of a servo across the persisted runs and the current one
+	Trend trend( uint8_t id ) const;
+
+	/// Return if the servo fails too many transactions (see Config::flakyFailureRate)
+	bool isFlaky( uint8_t id ) const;
+
+	/// Ids of the servos seen in this run, healthiest first
+	std::vector<uint8_t> rankByHealth() const;
+
+	/// Summary of the current run, one record per servo
+	std::vector<Record> currentRun() const;
+
+	/// Previous runs, as loaded
+	const std::vector<Record>& history() const;
+
+	/// Load the history of previous runs (replacing the current history)
+	/// @throw runtime_error on malformed input
+	void load( std::istream& in );
+	/// Load from a file. A missing file is an empty history.
+	void load( const std::string& path );
+
+	/// Write the history followed by the current run
+	void save( std::ostream& out ) const;
+	void save( const std::string& path ) const;
+
+private:
+	/// Score of a set of signals
+	float score( const Record& record ) const;
+
+	/// Summary of a servo for the current run
+	Record summary( uint8_t id, const Stats& stats ) const;
+
+	/// Running average, initialized with the first value
+	void average( float& avg, float value ) const;
+
+	/// Limits of a servo, read once
+	struct Limits
+	{
+		uint8_t tempMax = 0;
+		HiwonderBusServo::Limit vin;
+	};
+
+	Config m_config;
+	std::map<uint8_t, Stats> m_stats;
+	std::map<uint8_t, Limits> m_limits;
+	std::vector<Record> m_history;
+};
+
+
+
+
+//*********************************************************
+//                   IMPLEMENTATION
+//*********************************************************
+
+inline float HealthMonitor::Stats::timeoutRate() const
+{
+	return transactions ? static_cast<float>(timeouts)/transactions : 0.0f;
+}
+
+inline float HealthMonitor::Stats::corruptedRate() const
+{
+	return transactions ? static_cast<float>(corrupted)/transactions : 0.0f;
+}
+
+inline HealthMonitor::HealthMonitor(): m_config(Config())
+{
+}
+
+inline HealthMonitor::HealthMonitor( const Config& config ): m_config(config)
+{
+}
+
+inline void HealthMonitor::attach( HiwonderBusServo& servo )
+{
+	servo.setTransactionObserver(
+	    [this](uint8_t id, HiwonderBusServo::Transaction transaction, uint32_t latencyUs)
+	    {
+	        onTransaction(id, transaction, latencyUs);
+	    });
+}
+
+inline void HealthMonitor::detach( HiwonderBusServo& servo )
+{
+	servo.setTransactionObserver(nullptr);
+}
+
+inline void HealthMonitor::average( float& avg, float value ) const
+{
+	avg = std::isnan(avg) ? value : avg + m_config.averageWeight*(value - avg);
+}
+
+inline void HealthMonitor::onTransaction( uint8_t id, HiwonderBusServo::Transaction transaction, uint32_t latencyUs )
+{
+	Stats& stats = m_stats[id];
+	++stats.transactions;
+	switch (transaction)
+	{
+		case HiwonderBusServo::Transaction::Ok:
+			average(stats.latencyUs, static_cast<float>(latencyUs));
+			break;
+		case HiwonderBusServo::Transaction::Timeout:
+			++stats.timeouts;
+			break;
+		case HiwonderBusServo::Transaction::Corrupted:
+			++stats.corrupted;
+			break;
+	}
+}
+
+inline void HealthMonitor::sample( HiwonderBusServo& servo )
+{
+	const uint8_t id = servo.getId();
+	Stats& stats = m_stats[id];
+
+	try
+	{
+		if (!m_limits.count(id))
+		{
+			Limits limits;
+			limits.tempMax = servo.tempMaxLimitRead();
+			limits.vin = servo.vinLimitRead();
+			m_limits[id] = limits;
+		}
+		const Limits& limits = m_limits[id];
+
+		stats.tempHeadroom = static_cast<float>(limits.tempMax) - servo.tempRead();
+
+		const float vin = servo.vinRead();
+		stats.vinHeadroom = std::min(vin - limits.vin.minLimit, limits.vin.maxLimit - vin);
+
+		const float target = servo.moveTimeRead().position;
+		reportTrackingError(id, std::abs(target - servo.posRead()));
+	}
+	catch(const std::runtime_error&)
+	{
+		// Already accounted for by the transaction observer (if attached)
+	}
+}
+
+inline void HealthMonitor::reportTrackingError( uint8_t id, float error )
+{
+	average(m_stats[id].trackingError, error);
+}
+
+inline const HealthMonitor::Stats& HealthMonitor::stats( uint8_t id ) const
+{
+	static const Stats empty;
+	auto it = m_stats.find(id);
+	return it == m_stats.end() ? empty : it->second;
+}
+
+inline HealthMonitor::Record HealthMonitor::summary( uint8_t id, const Stats& stats ) const
+{
+	Record record;
+	record.id = id;
+	record.latencyUs = stats.latencyUs;
+	record.timeoutRate = stats.timeoutRate();
+	record.corruptedRate = stats.corruptedRate();
+	record.tempHeadroom = stats.tempHeadroom;
+	record.vinHeadroom = stats.vinHeadroom;
+	record.trackingError = stats.trackingError;
+	record.score = score(record);
+	return record;
+}
+
+inline float HealthMonitor::score( const Record& r ) const
+{
+	// Penalty of a signal past its threshold, capped to <maxPenalty> points
+	auto penalty = [](float excess, float pointsPerUnit, float maxPenalty)
+	{
+		if (std::isnan(excess) || excess <= 0.0f) return 0.0f;
+		return std::min(maxPenalty, excess*pointsPerUnit);
+	};
+
+	float result = 100.0f;
+	// Lost replies hurt the most: 10% timeouts cost all of the 40 points
+	result -= penalty(r.timeoutRate, 400.0f, 40.0f);
+	result -= penalty(r.corruptedRate, 400.0f, 20.0f);
+	result -= penalty(r.latencyUs - m_config.nominalLatencyUs, 10.0f/m_config.nominalLatencyUs, 10.0f);
+	result -= penalty(m_config.minTempHeadroom - r.tempHeadroom, 20.0f/m_config.minTempHeadroom, 20.0f);
+	result -= penalty(m_config.minVinHeadroom - r.vinHeadroom, 20.0f/m_config.minVinHeadroom, 20.0f);
+	result -= penalty(r.trackingError - m_config.nominalTrackingError, 10.0f/m_config.nominalTrackingError, 10.0f);
+	return std::max(0.0f, result);
+}
+
+inline float HealthMonitor::score( uint8_t id ) const
+{
+	return score(summary(id, stats(id)));
+}
+
+inline HealthMonitor::Trend HealthMonitor::trend( uint8_t id ) const
+{
+	std::vector<Record> records;
+	uint32_t lastRun = 0;
+	for (const auto& r: m_history)
+	{
+		if (r.id == id) records.push_back(r);
+		lastRun = std::max(lastRun, r.run);
+	}
+	if (m_stats.count(id))
+	{
+		records.push_back(summary(id, m_stats.at(id)));
+		records.back().run = lastRun+1;
+	}
+
+	// Least-squares slope of <value> versus run, ignoring unknown values
+	auto slope = [&records](float Record::* value)
+	{
+		double n=0, sx=0, sy=0, sxx=0, sxy=0;
+		for (const auto& r: records)
+		{
+			if (std::isnan(r.*value)) continue;
+			n += 1; sx += r.run; sy += r.*value;
+			sxx += double(r.run)*r.run; sxy += double(r.run)*(r.*value);
+		}
+		const double den = n*sxx - sx*sx;
+		return (n < 2 || den == 0.0) ? 0.0f : static_cast<float>((n*sxy - sx*sy)/den);
+	};
+
+	Trend result;
+	result.scorePerRun = slope(&Record::score);
+	result.latencyUsPerRun = slope(&Record::latencyUs);
+	return result;
+}
+
+inline bool HealthMonitor::isFlaky( uint8_t id ) const
+{
+	const Stats& s = stats(id);
+	return s.timeoutRate() + s.corruptedRate() > m_config.flakyFailureRate;
+}
+
+inline std::vector<uint8_t> HealthMonitor::rankByHealth() const
+{
+	std::vector<std::pair<float, uint8_t>> scores;
+	for (const auto& entry: m_stats) scores.emplace_back(score(entry.first), entry.first);
+	std::stable_sort(scores.begin(), scores.end(),
+	    [](const auto& a, const auto& b){ return a.first > b.first; });
+
+	std::vector<uint8_t> ids;
+	for (const auto& s: scores) ids.push_back(s.second);
+	return ids;
+}
+
+inline std::vector<HealthMonitor::Record> HealthMonitor::currentRun() const
+{
+	uint32_t lastRun = 0;
+	for (const auto& r: m_history) lastRun = std::max(lastRun, r.run);
+
+	std::vector<Record> records;
+	for (const auto& entry: m_stats)
+	{
+		records.push_back(summary(entry.first, entry.second));
+		records.back().run = lastRun+1;
+	}
+	return records;
+}
+
+inline const std::vector<HealthMonitor::Record>& HealthMonitor::history() const
+{
+	return m_history;
+}
+
+inline void HealthMonitor::load( std::istream& in )
+{
+	m_history.clear();
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line[0] == '#') continue;
+
+		// strtof is used as it reads "nan" (unknown values)
+		std::istringstream fields(line);
+		std::vector<float> values;
+		std::string field;
+		while (fields >> field)
+		{
+			char* end = nullptr;
+			values.push_back(std::strtof(field.c_str(), &end));
+			if (*end != '\0') throw std::runtime_error("Malformed health history line: " + line);
+		}
+		if (values.size() != 9) throw std::runtime_error("Malformed health history line: " + line);
+
+		Record r;
+		r.id = static_cast<uint8_t>(values[0]);
+		r.run = static_cast<uint32_t>(values[1]);
+		r.score = values[2];
+		r.latencyUs = values[3];
+		r.timeoutRate = values[4];
+		r.corruptedRate = values[5];
+		r.tempHeadroom = values[6];
+		r.vinHeadroom = values[7];
+		r.trackingError = values[8];
+		m_history.push_back(r);
+	}
+}
+
+inline void HealthMonitor::load( const std::string& path )
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		m_history.clear();
+		return;
+	}
+	load(in);
+}
+
+inline void HealthMonitor::save( std::ostream& out ) const
+{
+	out << "# id run score latencyUs timeoutRate corruptedRate tempHeadroom vinHeadroom trackingError\n";
+	std::vector<Record> records = m_history;
+	const auto current = currentRun();
+	records.insert(records.end(), current.begin(), current.end());
+
+	for (const auto& r: records)
+	{
+		out << static_cast<int>(r.id) << ' ' << r.run << ' ' << r.score << ' ' << r.latencyUs << ' '
+		    << r.timeoutRate << ' ' << r.corruptedRate << ' ' << r.tempHeadroom << ' '
+		    << r.vinHeadroom << ' ' << r.trackingError << '\n';
+	}
+	if (!out)
+	{
+		throw std::runtime_error("Unable to write health history");
+	}
+}
+
+inline void HealthMonitor::save( const std::string& path ) const
+{
+	std::ofstream out(path);
+	if (!out)
+	{
+		throw std::runtime_error("Unable to open health history for writing: " + path);
+	}
+	save(out);
+}
+
+}
+#endif //HIWONDER_RPI_HEALTH
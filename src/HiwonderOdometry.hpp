@@ -0,0 +1,380 @@
+/*
+ * This file is part of HiwonderRPI library
+ *
+ * HiwonderRPI is free software: you can redistribute it and/or modify
+ * it under ther terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HiwonderRPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HiwonderRPI. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Author: Adrian Maire escain (at) gmail.com
+ */
+
+#ifndef HIWONDER_RPI_ODOMETRY
+#define HIWONDER_RPI_ODOMETRY
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "HiwonderBusServo.hpp"
+
+namespace HiwonderRpi
+{
+
+/// Continuous wheel travel of a servo in motor mode.
+/// In motor mode the position reading wraps around every revolution, and is only
+///     reliable inside a valid band (0-1000 = 240deg); the remaining 120deg is a
+///     dead zone with meaningless readings.
+/// Each update predicts the wheel angle from the commanded speed, unwraps the
+///     reading to the revolution closest to this prediction, and blends both.
+///     In the dead zone, only the prediction is used.
+/// Convention: a positive motor speed increases the position reading.
+class WheelOdometry
+{
+public:
+	struct Config
+	{
+		/// Position units in a full revolution (0.24deg per unit)
+		float unitsPerRevolution = 1500.0f;
+		/// Readings outside [validMin, validMax] are in the dead zone
+		int16_t validMin = 0;
+		int16_t validMax = 1000;
+		/// Wheel angular speed, in position units per second, for a motor speed of 1
+		float unitsPerSecondPerSpeed = 1.5f;
+		/// Online refinement of unitsPerSecondPerSpeed from the readings, in [0,1] (0: disabled)
+		float calibrationRate = 0.05f;
+		/// Weight of the reading versus the prediction, in [0,1]
+		float measurementWeight = 0.8f;
+		/// Wheel radius in meters
+		float wheelRadius = 0.03f;
+		/// Forward direction: 1, or -1 for a wheel mounted reversed
+		int8_t direction = 1;
+	};
+
+	WheelOdometry();
+	WheelOdometry( const Config& config );
+
+	/// Restart from zero travel
+	/// @arg raw: current position reading
+	void reset( int16_t raw );
+
+	/// Integrate a new position reading
+	/// @arg raw: position reading
+	/// @arg motorSpeed: speed commanded to the servo since the previous update
+	/// @arg dt: time since the previous update in seconds
+	void update( int16_t raw, int16_t motorSpeed, float dt );
+
+	/// Integrate without reading (failed read): the commanded speed is used alone
+	void predict( int16_t motorSpeed, float dt );
+
+	/// Total travel in position units (servo frame, not affected by direction)
+	float travel() const;
+
+	/// Total forward distance of the wheel in meters
+	float distance() const;
+
+	/// Current (possibly calibrated) speed factor, see Config::unitsPerSecondPerSpeed
+	float speedFactor() const;
+
+	/// Forward direction of the wheel, see Config::direction
+	int8_t direction() const;
+
+	/// Longest period between updates allowing reliable unwrapping at <motorSpeed>:
+	///     the wheel must be read at least twice while crossing the valid band.
+	float maxUpdatePeriod( int16_t motorSpeed ) const;
+
+	/// Return if a reading is in the valid band
+	bool isValid( int16_t raw ) const;
+
+private:
+	Config m_config;
+	/// Unwrapped wheel angle in position units
+	float m_angle = 0.0f;
+	/// Travel since reset in position units
+	float m_travel = 0.0f;
+	/// Unwrapped angle of the last valid reading, and the commanded travel since
+	float m_lastMeasured = 0.0f;
+	float m_commandedSinceMeasured = 0.0f;
+	/// False until a valid reading anchors the angle (reset in the dead zone)
+	bool m_haveMeasured = false;
+};
+
+
+/// Differential drive odometry from two wheel servos in motor mode.
+/// update() must be called at the control rate (see WheelOdometry::maxUpdatePeriod).
+class DifferentialDriveOdometry
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Pose
+	{
+		/// Position in meters, heading in radians
+		float x = 0.0f;
+		float y = 0.0f;
+		float theta = 0.0f;
+	};
+
+	/// @arg left, right: wheel servos
+	/// @arg leftConfig, rightConfig: wheel configuration (usually one with direction=-1)
+	/// @arg trackWidth: distance between the wheels in meters
+	DifferentialDriveOdometry( HiwonderBusServo& left, HiwonderBusServo& right,
+	    const WheelOdometry::Config& leftConfig, const WheelOdometry::Config& rightConfig,
+	    float trackWidth );
+
+	/// Read the wheels and restart from the origin pose
+	void reset();
+
+	/// Set the wheels in motor mode with the given forward speeds [-1000,1000]
+	void setSpeed( int16_t left, int16_t right );
+
+	/// Read both wheels and integrate the pose
+	const Pose& update();
+
+	/// Current pose
+	const Pose& pose() const;
+
+	/// Forward distance of each wheel since reset, in meters
+	float leftDistance() const;
+	float rightDistance() const;
+
+	/// Integrate the wheel distances (meters) into a pose (midpoint integration)
+	static Pose integrate( const Pose& pose, float leftDelta, float rightDelta, float trackWidth );
+
+private:
+	struct Wheel
+	{
+		HiwonderBusServo& servo;
+		WheelOdometry odometry;
+		int16_t motorSpeed = 0;
+		Clock::time_point lastSample;
+	};
+
+	/// Read and integrate one wheel, return the distance increment
+	static float updateWheel( Wheel& wheel );
+
+	Wheel m_left;
+	Wheel m_right;
+	float m_trackWidth;
+	Pose m_pose;
+};
+
+
+
+
+//*********************************************************
+//                   IMPLEMENTATION
+//*********************************************************
+
+inline WheelOdometry::WheelOdometry(): m_config(Config())
+{
+}
+
+inline WheelOdometry::WheelOdometry( const Config& config ): m_config(config)
+{
+}
+
+inline void WheelOdometry::reset( int16_t raw )
+{
+	m_haveMeasured = isValid(raw);
+	// A reading in the dead zone is meaningless: start in the middle of it,
+	//     the angle is then anchored on the first valid reading (see update)
+	m_angle = m_haveMeasured ? raw :
+	    (m_config.validMax + m_config.validMin + m_config.unitsPerRevolution)/2.0f;
+	m_travel = 0.0f;
+	m_lastMeasured = m_angle;
+	m_commandedSinceMeasured = 0.0f;
+}
+
+inline bool WheelOdometry::isValid( int16_t raw ) const
+{
+	return raw >= m_config.validMin && raw <= m_config.validMax;
+}
+
+inline void WheelOdometry::update( int16_t raw, int16_t motorSpeed, float dt )
+{
+	if (!isValid(raw))
+	{
+		predict(motorSpeed, dt);
+		return;
+	}
+
+	const float commanded = static_cast<float>(motorSpeed)*dt;
+	const float expected = m_angle + m_config.unitsPerSecondPerSpeed*commanded;
+
+	// Unwrap the reading to the revolution closest to the prediction
+	const float rev = m_config.unitsPerRevolution;
+	const float measured = raw + rev*std::round((expected - raw)/rev);
+
+	// First valid reading since a reset in the dead zone: the start angle was
+	//     unknown, so only the prediction is travel, and the angle is anchored here
+	if (!m_haveMeasured)
+	{
+		m_travel += expected - m_angle;
+		m_angle = measured;
+		m_lastMeasured = measured;
+		m_commandedSinceMeasured = 0.0f;
+		m_haveMeasured = true;
+		return;
+	}
+
+	// Refine the speed factor from the travel measured since the previous valid reading
+	m_commandedSinceMeasured += commanded;
+	if (m_config.calibrationRate > 0.0f && std::abs(m_commandedSinceMeasured) > 1.0f)
+	{
+		const float ratio = (measured - m_lastMeasured)/m_commandedSinceMeasured;
+		if (ratio > 0.0f)
+		{
+			m_config.unitsPerSecondPerSpeed += m_config.calibrationRate*(ratio - m_config.unitsPerSecondPerSpeed);
+		}
+	}
+	m_lastMeasured = measured;
+	m_commandedSinceMeasured = 0.0f;
+	m_haveMeasured = true;
+
+	const float angle = expected + m_config.measurementWeight*(measured - expected);
+	m_travel += angle - m_angle;
+	m_angle = angle;
+}
+
+inline void WheelOdometry::predict( int16_t motorSpeed, float dt )
+{
+	const float commanded = static_cast<float>(motorSpeed)*dt;
+	const float delta = m_config.unitsPerSecondPerSpeed*commanded;
+	m_commandedSinceMeasured += commanded;
+	m_angle += delta;
+	m_travel += delta;
+}
+
+inline float WheelOdometry::travel() const
+{
+	return m_travel;
+}
+
+inline float WheelOdometry::distance() const
+{
+	constexpr float Pi = 3.14159265358979f;
+	return m_config.direction*m_travel*2.0f*Pi*m_config.wheelRadius/m_config.unitsPerRevolution;
+}
+
+inline float WheelOdometry::speedFactor() const
+{
+	return m_config.unitsPerSecondPerSpeed;
+}
+
+inline int8_t WheelOdometry::direction() const
+{
+	return m_config.direction;
+}
+
+inline float WheelOdometry::maxUpdatePeriod( int16_t motorSpeed ) const
+{
+	const float speed = std::abs(m_config.unitsPerSecondPerSpeed*motorSpeed);
+	if (speed <= 0.0f) return INFINITY;
+	return (m_config.validMax - m_config.validMin)/(2.0f*speed);
+}
+
+inline DifferentialDriveOdometry::DifferentialDriveOdometry( HiwonderBusServo& left, HiwonderBusServo& right,
+    const WheelOdometry::Config& leftConfig, const WheelOdometry::Config& rightConfig, float trackWidth ):
+	m_left{left, WheelOdometry(leftConfig), 0, Clock::now()},
+	m_right{right, WheelOdometry(rightConfig), 0, Clock::now()},
+	m_trackWidth(trackWidth)
+{
+}
+
+inline void DifferentialDriveOdometry::reset()
+{
+	for (Wheel* wheel: {&m_left, &m_right})
+	{
+		wheel->odometry.reset(wheel->servo.posRead());
+		wheel->lastSample = Clock::now();
+	}
+	m_pose = Pose();
+}
+
+inline void DifferentialDriveOdometry::setSpeed( int16_t left, int16_t right )
+{
+	m_left.motorSpeed = static_cast<int16_t>(left*m_left.odometry.direction());
+	m_right.motorSpeed = static_cast<int16_t>(right*m_right.odometry.direction());
+	m_left.servo.servoOrMotorModeWrite(HiwonderBusServo::Mode::Motor, m_left.motorSpeed);
+	m_right.servo.servoOrMotorModeWrite(HiwonderBusServo::Mode::Motor, m_right.motorSpeed);
+}
+
+inline float DifferentialDriveOdometry::updateWheel( Wheel& wheel )
+{
+	const float before = wheel.odometry.distance();
+
+	const auto sent = Clock::now();
+	wheel.servo.posReadRequest();
+	int16_t raw = 0;
+	bool ok = true;
+	try
+	{
+		raw = wheel.servo.posReadReply();
+	}
+	catch(const std::runtime_error&)
+	{
+		ok = false;
+	}
+	const auto received = Clock::now();
+
+	// The reading is taken as sampled in the middle of the request-reply
+	const auto sampled = sent + (received-sent)/2;
+	const float dt = std::chrono::duration<float>(sampled - wheel.lastSample).count();
+	wheel.lastSample = sampled;
+
+	if (ok) wheel.odometry.update(raw, wheel.motorSpeed, dt);
+	else wheel.odometry.predict(wheel.motorSpeed, dt);
+
+	return wheel.odometry.distance() - before;
+}
+
+inline const DifferentialDriveOdometry::Pose& DifferentialDriveOdometry::update()
+{
+	const float leftDelta = updateWheel(m_left);
+	const float rightDelta = updateWheel(m_right);
+	m_pose = integrate(m_pose, leftDelta, rightDelta, m_trackWidth);
+	return m_pose;
+}
+
+inline const DifferentialDriveOdometry::Pose& DifferentialDriveOdometry::pose() const
+{
+	return m_pose;
+}
+
+inline float DifferentialDriveOdometry::leftDistance() const
+{
+	return m_left.odometry.distance();
+}
+
+inline float DifferentialDriveOdometry::rightDistance() const
+{
+	return m_right.odometry.distance();
+}
+
+inline DifferentialDriveOdometry::Pose DifferentialDriveOdometry::integrate( const Pose& pose,
+    float leftDelta, float rightDelta, float trackWidth )
+{
+	const float forward = (leftDelta + rightDelta)/2.0f;
+	const float turn = (rightDelta - leftDelta)/trackWidth;
+	const float heading = pose.theta + turn/2.0f;
+
+	Pose result;
+	result.x = pose.x + forward*std::cos(heading);
+	result.y = pose.y + forward*std::sin(heading);
+	result.theta = pose.theta + turn;
+	return result;
+}
+
+}
+#endif //HIWONDER_RPI_ODOMETRY
@@ -0,0 +1,385 @@
+/*
+ * This file is part of HiwonderRPI library
+ *
+ * HiwonderRPI is free software: you can redistribute it and/or modify
+ * it under ther terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HiwonderRPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HiwonderRPI. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Author: Adrian Maire escain (at) gmail.com
+ */
+
+#ifndef HIWONDER_RPI_ROBOT
+#define HIWONDER_RPI_ROBOT
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include <unistd.h>
+
+#include <wiringPi.h>
+#include <wiringSerial.h>
+
+#include "HiwonderBusServo.hpp"
+
+namespace HiwonderRpi
+{
+
+/// Command sent to a joint on each tick
+enum class JointCommand: uint8_t
+{
+	/// moveTimeWrite of the joint position
+	Position = 0,
+	/// servoOrMotorModeWrite in motor mode with the joint value as speed
+	Speed = 1
+};
+
+/// A joint of the robot, known at compile time.
+/// Joint values are in servo units around the joint zero:
+///     servo position = Offset + Direction*value (speed = Direction*value).
+/// @arg Id: servo id on its bus
+/// @arg Command: what is written on each tick
+/// @arg Direction: 1, or -1 for a servo mounted reversed
+/// @arg Offset: servo position of the joint zero (unused for Speed joints)
+template <uint8_t Id, JointCommand Command = JointCommand::Position,
+    int8_t Direction = 1, int16_t Offset = 0>
+struct Joint
+{
+	static_assert(Direction == 1 || Direction == -1, "Joint direction must be 1 or -1");
+	static_assert(Id != 254, "Joint id can not be the broadcast id");
+
+	constexpr static uint8_t id = Id;
+	constexpr static JointCommand command = Command;
+	constexpr static int8_t direction = Direction;
+	constexpr static int16_t offset = Offset;
+
+	/// Size of the frame written on each tick
+	constexpr static size_t FrameSize = Command == JointCommand::Position ?
+	    HiwonderBusServo::MoveTimeWriteFrameSize : HiwonderBusServo::ServoOrMotorModeWriteFrameSize;
+
+	/// Joint value to servo position (or speed), and back
+	constexpr static int16_t toServo( int16_t value );
+	constexpr static int16_t fromServo( int16_t raw );
+
+	/// Encode the tick command of <value> into <out> (FrameSize bytes)
+	/// @arg time: move time in ms (Position joints only)
+	static void encode( int16_t value, uint16_t time, uint8_t* out );
+};
+
+/// Default UART device of the servo bus (see HiwonderBusServo constructor)
+struct DefaultDevice
+{
+	constexpr static const char* path = "/dev/ttyAMA0";
+	constexpr static int baudRate = 115200;
+};
+
+/// A servo bus: a UART device and the joints connected to it, in tick order.
+/// @arg Device: type with static path and baudRate (see DefaultDevice)
+template <typename Device, typename... Joints>
+struct Bus
+{
+	static_assert(sizeof...(Joints) > 0, "A bus must have at least one joint");
+
+	using DeviceType = Device;
+
+	/// Number of joints on the bus
+	constexpr static size_t size = sizeof...(Joints);
+
+	/// Bytes written on each tick (all joint frames, back to back)
+	constexpr static size_t FrameBytes = (Joints::FrameSize + ...);
+	using Frames = std::array<uint8_t, FrameBytes>;
+
+	/// Servo ids, in joint order
+	constexpr static std::array<uint8_t, size> ids{Joints::id...};
+
+	/// Position read requests, built at compile time
+	constexpr static std::array<std::array<uint8_t, HiwonderBusServo::PosReadFrameSize>, size> readRequests
+	{
+		HiwonderBusServo::encodePosRead(Joints::id)...
+	};
+
+	/// Encode the tick commands of the <size> joint values <values> into <frames>
+	static void encode( const int16_t* values, uint16_t time, Frames& frames );
+
+	/// Read the position of each Position joint into <values> (joint units)
+	/// Speed joints and joints that fail to reply keep their value.
+	/// @return number of joints that failed to reply
+	static size_t read( int fd, int16_t* values );
+
+private:
+	/// Start of each joint frame in Frames
+	constexpr static std::array<size_t, size> frameOffsets();
+
+	template <size_t... I>
+	static void encode( const int16_t* values, uint16_t time, Frames& frames, std::index_sequence<I...> );
+
+	template <size_t... I>
+	static size_t read( int fd, int16_t* values, std::index_sequence<I...> );
+
+	/// Request and read the position of one joint, return false on failure
+	/// Speed joints are not read: their value is the commanded speed.
+	template <typename J>
+	static bool readJoint( int fd, const std::array<uint8_t, HiwonderBusServo::PosReadFrameSize>& request,
+	    int16_t& value );
+};
+
+/// A robot made of one or more buses, whose configuration is fixed at compile time.
+/// The state of all joints is a fixed-size array (bus after bus, in joint order),
+///     encoded each tick in fixed-size frame buffers without allocation, with one
+///     write per bus. Loops over joints are unrolled by the compiler.
+/// Example:
+///     using Leg = Bus<DefaultDevice, Joint<1>, Joint<2, JointCommand::Position, -1, 500>>;
+///     Robot<Leg> robot;
+///     robot.write({0, 120}, 20);
+template <typename... Buses>
+class Robot
+{
+public:
+	static_assert(sizeof...(Buses) > 0, "A robot must have at least one bus");
+
+	/// Number of joints, of all buses
+	constexpr static size_t jointCount = (Buses::size + ...);
+
+	/// Value of every joint, see Joint
+	using State = std::array<int16_t, jointCount>;
+
+	/// Tick frames of every bus
+	using Frames = std::tuple<typename Buses::Frames...>;
+
+	/// Open the UART device of every bus
+	/// @throw runtime_error if a device can not be opened
+	Robot();
+	/// Robot object can not be copied (UART access is unique)
+	Robot( const Robot& ) = delete;
+	Robot& operator=( const Robot& ) = delete;
+	~Robot();
+
+	/// Encode the tick commands of <state> into <frames>, without bus access
+	/// @arg time: move time in ms of Position joints
+	static void encode( const State& state, uint16_t time, Frames& frames );
+
+	/// Send the tick commands of <state>: one write per bus
+	/// @throw runtime_error if a write fails
+	void write( const State& state, uint16_t time = 0 );
+
+	/// Read the position of every Position joint into <state>
+	/// Speed joints and joints that fail to reply keep their value, so <state>
+	///     can be read and written back on each tick.
+	/// @return number of joints that failed to reply
+	size_t read( State& state ) const;
+
+private:
+	/// First joint of each bus in State
+	constexpr static std::array<size_t, sizeof...(Buses)> jointOffsets();
+
+	template <size_t... B>
+	static void encode( const State& state, uint16_t time, Frames& frames, std::index_sequence<B...> );
+
+	template <size_t... B>
+	void write( std::index_sequence<B...> ) const;
+
+	template <size_t... B>
+	size_t read( State& state, std::index_sequence<B...> ) const;
+
+	std::array<int, sizeof...(Buses)> m_fds;
+	Frames m_frames;
+};
+
+
+
+
+//*********************************************************
+//                   IMPLEMENTATION
+//*********************************************************
+
+template <uint8_t Id, JointCommand Command, int8_t Direction, int16_t Offset>
+constexpr int16_t Joint<Id, Command, Direction, Offset>::toServo( int16_t value )
+{
+	if (Command == JointCommand::Speed) return static_cast<int16_t>(Direction*value);
+	return static_cast<int16_t>(Offset + Direction*value);
+}
+
+template <uint8_t Id, JointCommand Command, int8_t Direction, int16_t Offset>
+constexpr int16_t Joint<Id, Command, Direction, Offset>::fromServo( int16_t raw )
+{
+	if (Command == JointCommand::Speed) return raw;
+	return static_cast<int16_t>(Direction*(raw - Offset));
+}
+
+template <uint8_t Id, JointCommand Command, int8_t Direction, int16_t Offset>
+inline void Joint<Id, Command, Direction, Offset>::encode( int16_t value, uint16_t time, uint8_t* out )
+{
+	if constexpr (Command == JointCommand::Position)
+	{
+		HiwonderBusServo::encodeMoveTimeWrite(Id, toServo(value), time, out);
+	}
+	else
+	{
+		HiwonderBusServo::encodeServoOrMotorModeWrite(Id, HiwonderBusServo::Mode::Motor, toServo(value), out);
+	}
+}
+
+template <typename Device, typename... Joints>
+constexpr std::array<size_t, Bus<Device, Joints...>::size> Bus<Device, Joints...>::frameOffsets()
+{
+	constexpr std::array<size_t, size> sizes{Joints::FrameSize...};
+	std::array<size_t, size> offsets{};
+	for (size_t i=1; i<size; ++i) offsets[i] = offsets[i-1] + sizes[i-1];
+	return offsets;
+}
+
+template <typename Device, typename... Joints>
+inline void Bus<Device, Joints...>::encode( const int16_t* values, uint16_t time, Frames& frames )
+{
+	encode(values, time, frames, std::index_sequence_for<Joints...>());
+}
+
+template <typename Device, typename... Joints>
+template <size_t... I>
+inline void Bus<Device, Joints...>::encode( const int16_t* values, uint16_t time, Frames& frames,
+    std::index_sequence<I...> )
+{
+	constexpr auto offsets = frameOffsets();
+	(Joints::encode(values[I], time, frames.data() + offsets[I]), ...);
+}
+
+template <typename Device, typename... Joints>
+inline size_t Bus<Device, Joints...>::read( int fd, int16_t* values )
+{
+	return read(fd, values, std::index_sequence_for<Joints...>());
+}
+
+template <typename Device, typename... Joints>
+template <size_t... I>
+inline size_t Bus<Device, Joints...>::read( int fd, int16_t* values, std::index_sequence<I...> )
+{
+	return (static_cast<size_t>(!readJoint<Joints>(fd, readRequests[I], values[I])) + ...);
+}
+
+template <typename Device, typename... Joints>
+template <typename J>
+inline bool Bus<Device, Joints...>::readJoint( int fd,
+    const std::array<uint8_t, HiwonderBusServo::PosReadFrameSize>& request, int16_t& value )
+{
+	if constexpr (J::command == JointCommand::Speed)
+	{
+		return true;
+	}
+	else
+	{
+		// The frames of the last write may still be queued: let them go out first
+		HiwonderBusServo::discardInput(fd);
+		if (::write(fd, request.data(), request.size()) != static_cast<ssize_t>(request.size()))
+		{
+			return false;
+		}
+
+		HiwonderBusServo::Buffer reply;
+		int16_t raw = 0;
+		try
+		{
+			HiwonderBusServo::readFrame(fd, reply);
+		}
+		catch(const std::runtime_error&)
+		{
+			return false;
+		}
+		if (!HiwonderBusServo::decodePosReply(J::id, reply, raw))
+		{
+			return false;
+		}
+		value = J::fromServo(raw);
+		return true;
+	}
+}
+
+template <typename... Buses>
+inline Robot<Buses...>::Robot(): m_fds{serialOpen(Buses::DeviceType::path, Buses::DeviceType::baudRate)...}
+{
+	auto setupResult = wiringPiSetup();
+	for (int fd: m_fds)
+	{
+		if (0>fd || -1==setupResult)
+		{
+			for (int opened: m_fds) if (opened>=0) serialClose(opened);
+			throw std::runtime_error("Unable to setup UART device.");
+		}
+	}
+}
+
+template <typename... Buses>
+inline Robot<Buses...>::~Robot()
+{
+	for (int fd: m_fds) serialClose(fd);
+}
+
+template <typename... Buses>
+constexpr std::array<size_t, sizeof...(Buses)> Robot<Buses...>::jointOffsets()
+{
+	constexpr std::array<size_t, sizeof...(Buses)> sizes{Buses::size...};
+	std::array<size_t, sizeof...(Buses)> offsets{};
+	for (size_t i=1; i<sizeof...(Buses); ++i) offsets[i] = offsets[i-1] + sizes[i-1];
+	return offsets;
+}
+
+template <typename... Buses>
+inline void Robot<Buses...>::encode( const State& state, uint16_t time, Frames& frames )
+{
+	encode(state, time, frames, std::index_sequence_for<Buses...>());
+}
+
+template <typename... Buses>
+template <size_t... B>
+inline void Robot<Buses...>::encode( const State& state, uint16_t time, Frames& frames,
+    std::index_sequence<B...> )
+{
+	constexpr auto offsets = jointOffsets();
+	(Buses::encode(state.data() + offsets[B], time, std::get<B>(frames)), ...);
+}
+
+template <typename... Buses>
+inline void Robot<Buses...>::write( const State& state, uint16_t time )
+{
+	encode(state, time, m_frames);
+	write(std::index_sequence_for<Buses...>());
+}
+
+template <typename... Buses>
+template <size_t... B>
+inline void Robot<Buses...>::write( std::index_sequence<B...> ) const
+{
+	const bool written = ((::write(m_fds[B], std::get<B>(m_frames).data(), std::get<B>(m_frames).size())
+	    == static_cast<ssize_t>(std::get<B>(m_frames).size())) & ...);
+	if (!written)
+	{
+		throw std::runtime_error("Unable to write the robot frames to the UART device.");
+	}
+}
+
+template <typename... Buses>
+inline size_t Robot<Buses...>::read( State& state ) const
+{
+	return read(state, std::index_sequence_for<Buses...>());
+}
+
+template <typename... Buses>
+template <size_t... B>
+inline size_t Robot<Buses...>::read( State& state, std::index_sequence<B...> ) const
+{
+	constexpr auto offsets = jointOffsets();
+	return (Buses::read(m_fds[B], state.data() + offsets[B]) + ...);
+}
+
+}
+#endif //HIWONDER_RPI_ROBOT
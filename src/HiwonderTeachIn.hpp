@@ -0,0 +1,260 @@
+/*
+ * This file is part of HiwonderRPI library
+ *
+ * HiwonderRPI is free software: you can redistribute it and/or modify
+ * it under ther terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HiwonderRPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HiwonderRPI. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Author: Adrian Maire escain (at) gmail.com
+ */
+
+#ifndef HIWONDER_RPI_TEACH_IN
+#define HIWONDER_RPI_TEACH_IN
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "HiwonderBusServo.hpp"
+#include "HiwonderTrack.hpp"
+
+namespace HiwonderRpi
+{
+
+/// Teach-in: servos are unloaded so they can be moved by hand, and their
+///     positions are sampled as fast as the bus allows into a Track, which can
+///     later be replayed with TrackPlayer.
+/// Position reads are pipelined: the request of the next servo is sent as soon
+///     as the reply of the previous one is decoded, and the bookkeeping of a
+///     sample is done while the next request is on the bus.
+class TeachInRecorder
+{
+public:
+	using ServoRef = std::reference_wrapper<HiwonderBusServo>;
+	using Clock = std::chrono::steady_clock;
+
+	/// @arg servos: servos to record, in the column order of the resulting track
+	TeachInRecorder( std::vector<ServoRef> servos );
+
+	/// Stop the recording (servos are loaded again) if still running
+	~TeachInRecorder();
+
+	TeachInRecorder( const TeachInRecorder& ) = delete;
+	TeachInRecorder& operator=( const TeachInRecorder& ) = delete;
+
+	/// Unload the servos, read their initial position and start a new track
+	/// @throw runtime_error if an initial position can not be read (the servos
+	///     are loaded again)
+	void start();
+
+	/// Read the position of every servo once and append a frame to the track
+	/// A failed read keeps the previous position of that servo (see failedReads)
+	/// @throw runtime_error past the track time range (32 bits of microseconds,
+	///     about 71 minutes since start)
+	void sample();
+
+	/// Sample during <duration>
+	/// @arg period: time between frames, zero to sample at the maximum rate of the bus
+	/// @throw runtime_error if <duration> does not fit the track time range
+	void record( std::chrono::microseconds duration,
+	    std::chrono::microseconds period = std::chrono::microseconds(0) );
+
+	/// Hold the servos at their last recorded position and load them again
+	void stop();
+
+	/// True between start and stop
+	bool isRecording() const;
+
+	/// Recorded track
+	const Track& track() const;
+
+	/// Number of position reads that failed (timeout, corrupted reply) since start
+	size_t failedReads() const;
+
+private:
+	std::vector<ServoRef> m_servos;
+	Track m_track;
+	/// Last known position of each servo
+	std::vector<int16_t> m_frame;
+	Clock::time_point m_start;
+	size_t m_failedReads = 0;
+	bool m_recording = false;
+};
+
+
+
+
+//*********************************************************
+//                   IMPLEMENTATION
+//*********************************************************
+
+inline TeachInRecorder::TeachInRecorder( std::vector<ServoRef> servos ): m_servos(std::move(servos))
+{
+}
+
+inline TeachInRecorder::~TeachInRecorder()
+{
+	try
+	{
+		if (m_recording) stop();
+	}
+	catch(...)
+	{
+		// Destructor must not throw, servos stay unloaded
+	}
+}
+
+inline void TeachInRecorder::start()
+{
+	m_track = Track();
+	m_frame.assign(m_servos.size(), 0);
+	m_failedReads = 0;
+
+	size_t unloaded = 0;
+	try
+	{
+		for (; unloaded<m_servos.size(); ++unloaded)
+		{
+			HiwonderBusServo& servo = m_servos[unloaded].get();
+			servo.loadOrUnloadWrite(HiwonderBusServo::LoadMode::Unload);
+			m_track.ids.push_back(servo.getId());
+			m_frame[unloaded] = servo.posRead();
+		}
+	}
+	catch(const std::runtime_error&)
+	{
+		// Do not leave servos limp: hold the ones read where they are, load them all
+		for (size_t i=0; i<=unloaded && i<m_servos.size(); ++i)
+		{
+			try
+			{
+				if (i < unloaded) m_servos[i].get().moveTimeWrite(m_frame[i], 0);
+				m_servos[i].get().loadOrUnloadWrite(HiwonderBusServo::LoadMode::Load);
+			}
+			catch(const std::runtime_error&)
+			{
+				// Keep loading the others
+			}
+		}
+		throw;
+	}
+
+	m_recording = true;
+	m_start = Clock::now();
+}
+
+inline void TeachInRecorder::sample()
+{
+	if (!m_recording)
+	{
+		throw std::runtime_error("TeachInRecorder::sample called before start");
+	}
+	if (m_servos.empty()) return;
+
+	// Sum of the sample times (middle of request-reply) relative to m_start
+	int64_t sumUs = 0;
+
+	auto sent = Clock::now();
+	m_servos[0].get().posReadRequest();
+
+	for (size_t i=0; i<m_servos.size(); ++i)
+	{
+		int16_t pos = m_frame[i];
+		bool ok = true;
+		try
+		{
+			pos = m_servos[i].get().posReadReply();
+		}
+		catch(const std::runtime_error&)
+		{
+			ok = false;
+		}
+		const auto received = Clock::now();
+
+		// Put the next request on the bus before doing our bookkeeping
+		auto nextSent = received;
+		if (i+1 < m_servos.size())
+		{
+			nextSent = Clock::now();
+			m_servos[i+1].get().posReadRequest();
+		}
+
+		if (ok) m_frame[i] = pos;
+		else ++m_failedReads;
+
+		const auto middle = sent + (received-sent)/2;
+		sumUs += std::chrono::duration_cast<std::chrono::microseconds>(middle-m_start).count();
+		sent = nextSent;
+	}
+
+	// The frame is stamped at the mean time of its samples
+	const int64_t timestampUs = sumUs/static_cast<int64_t>(m_servos.size());
+	if (timestampUs > std::numeric_limits<uint32_t>::max())
+	{
+		throw std::runtime_error("TeachInRecorder: track time range exceeded");
+	}
+	const auto timestamp = static_cast<uint32_t>(timestampUs);
+	m_track.addFrame(std::max(timestamp, m_track.duration()), m_frame.data());
+}
+
+inline void TeachInRecorder::record( std::chrono::microseconds duration, std::chrono::microseconds period )
+{
+	if (duration.count() < 0 || duration.count() > std::numeric_limits<uint32_t>::max())
+	{
+		throw std::runtime_error("TeachInRecorder: duration out of the track time range");
+	}
+	const auto begin = Clock::now();
+	auto next = begin;
+	while (Clock::now()-begin < duration)
+	{
+		if (period.count() > 0)
+		{
+			std::this_thread::sleep_until(next);
+			next += period;
+		}
+		sample();
+	}
+}
+
+inline void TeachInRecorder::stop()
+{
+	m_recording = false;
+	for (size_t i=0; i<m_servos.size(); ++i)
+	{
+		// Set the target first: loading would otherwise jump to the last commanded position
+		m_servos[i].get().moveTimeWrite(m_frame[i], 0);
+		m_servos[i].get().loadOrUnloadWrite(HiwonderBusServo::LoadMode::Load);
+	}
+}
+
+inline bool TeachInRecorder::isRecording() const
+{
+	return m_recording;
+}
+
+inline const Track& TeachInRecorder::track() const
+{
+	return m_track;
+}
+
+inline size_t TeachInRecorder::failedReads() const
+{
+	return m_failedReads;
+}
+
+}
+#endif //HIWONDER_RPI_TEACH_IN
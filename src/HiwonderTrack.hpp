@@ -0,0 +1,379 @@
+/*
+ * This file is part of HiwonderRPI library
+ *
+ * HiwonderRPI is free software: you can redistribute it and/or modify
+ * it under ther terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HiwonderRPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HiwonderRPI. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Author: Adrian Maire escain (at) gmail.com
+ */
+
+#ifndef HIWONDER_RPI_TRACK
+#define HIWONDER_RPI_TRACK
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HiwonderBusServo.hpp"
+#include "HiwonderBusTiming.hpp"
+
+namespace HiwonderRpi
+{
+
+/// A track is a timed sequence of positions for a set of servos, ready to
+///     be streamed without any computation (recorded by teach-in, baked, ...).
+/// Storage is compact: one timestamp per frame and one int16 per servo and frame.
+struct Track
+{
+	/// Servo ids, one column per id
+	std::vector<uint8_t> ids;
+	/// Time of each frame, in microseconds since the start of the track
+	std::vector<uint32_t> timestamps;
+	/// Positions, frame after frame: positions[frame*ids.size() + column]
+	std::vector<int16_t> positions;
+
+	/// Number of frames in the track
+	size_t frameCount() const;
+
+	/// Duration of the track in microseconds (timestamp of the last frame)
+	uint32_t duration() const;
+
+	/// Pointer to the ids.size() positions of the given frame
+	const int16_t* frame( size_t index ) const;
+	int16_t* frame( size_t index );
+
+	/// Position of <column> at <timeUs>, linearly interpolated between frames
+	///     (the first and last frames hold before and after the track)
+	float position( double timeUs, size_t column ) const;
+
+	/// Append a frame: ids.size() positions are read from <pos>
+	/// @arg timestamp: in microseconds since start, must not be before the previous frame
+	void addFrame( uint32_t timestamp, const int16_t* pos );
+
+	/// Write the track in binary (little endian) format
+	void save( std::ostream& out ) const;
+	void save( const std::string& path ) const;
+
+	/// Read a track written by save
+	/// @throw runtime_error if the stream is not a valid track
+	static Track load( std::istream& in );
+	static Track load( const std::string& path );
+};
+
+
+/// Stream a track to the servos, sending each frame at its timestamp
+class TrackPlayer
+{
+public:
+	using ServoRef = std::reference_wrapper<HiwonderBusServo>;
+
+	/// @arg servos: servos to drive, one for each id of the tracks to play (any order)
+	TrackPlayer( std::vector<ServoRef> servos );
+
+	/// Same, compensating the bus latency: the setpoint sent to each servo is
+	///     the track position at the time the command takes effect on it,
+	///     given its position in the burst of frames (see BusTiming)
+	TrackPlayer( std::vector<ServoRef> servos, const BusTiming& timing );
+
+	/// Time given to the servos to reach the first frame before the track starts
+	///     (default 1s): they may be anywhere, e.g. at the end pose of a teach-in.
+	///     Zero starts immediately.
+	/// @throw runtime_error if above 65535ms (moveTimeWrite limit)
+	void setLeadIn( std::chrono::milliseconds leadIn );
+
+	/// Play the whole track (blocking)
+	/// The servos first move to the first frame in the lead-in time, then each frame
+	///     is sent with moveTimeWrite, with the time to the next frame so the servo
+	///     interpolates between frames.
+	/// @throw runtime_error if a track id has no servo
+	void play( const Track& track ) const;
+
+private:
+	/// Return, for each column of the track, the index of the servo in m_servos
+	std::vector<size_t> mapColumns( const Track& track ) const;
+
+	std::vector<ServoRef> m_servos;
+	BusTiming m_timing;
+	bool m_compensate = false;
+	std::chrono::milliseconds m_leadIn = std::chrono::milliseconds(1000);
+};
+
+
+
+
+//*********************************************************
+//                   IMPLEMENTATION
+//*********************************************************
+
+namespace TrackFormat
+{
+	/// File signature and version
+	constexpr char Magic[4] = {'H','W','T','K'};
+	constexpr uint8_t Version = 1;
+
+	template <typename T>
+	inline void writeLE( std::ostream& out, T value )
+	{
+		for (size_t i=0; i<sizeof(T); ++i)
+		{
+			out.put(static_cast<char>(static_cast<uint64_t>(value)>>(8*i)));
+		}
+	}
+
+	template <typename T>
+	inline T readLE( std::istream& in )
+	{
+		uint64_t value = 0;
+		for (size_t i=0; i<sizeof(T); ++i)
+		{
+			const int c = in.get();
+			if (c == std::char_traits<char>::eof())
+			{
+				throw std::runtime_error("Unexpected end of track");
+			}
+			value |= static_cast<uint64_t>(static_cast<uint8_t>(c))<<(8*i);
+		}
+		return static_cast<T>(value);
+	}
+}
+
+inline size_t Track::frameCount() const
+{
+	return timestamps.size();
+}
+
+inline uint32_t Track::duration() const
+{
+	return timestamps.empty() ? 0 : timestamps.back();
+}
+
+inline const int16_t* Track::frame( size_t index ) const
+{
+	return positions.data() + index*ids.size();
+}
+
+inline int16_t* Track::frame( size_t index )
+{
+	return positions.data() + index*ids.size();
+}
+
+inline float Track::position( double timeUs, size_t column ) const
+{
+	if (timestamps.empty())
+	{
+		throw std::runtime_error("Track::position on an empty track");
+	}
+
+	// First frame after timeUs
+	const auto next = std::upper_bound(timestamps.begin(), timestamps.end(), timeUs,
+	    [](double t, uint32_t stamp){ return t < stamp; });
+	if (next == timestamps.begin()) return frame(0)[column];
+	if (next == timestamps.end()) return frame(frameCount()-1)[column];
+
+	const size_t f = static_cast<size_t>(next - timestamps.begin());
+	const double t0 = timestamps[f-1];
+	const double t1 = timestamps[f];
+	const float p0 = frame(f-1)[column];
+	const float p1 = frame(f)[column];
+	return p0 + static_cast<float>((timeUs - t0)/(t1 - t0))*(p1 - p0);
+}
+
+inline void Track::addFrame( uint32_t timestamp, const int16_t* pos )
+{
+	if (!timestamps.empty() && timestamp < timestamps.back())
+	{
+		throw std::runtime_error("Track frames must be added in time order");
+	}
+	timestamps.push_back(timestamp);
+	positions.insert(positions.end(), pos, pos+ids.size());
+}
+
+inline void Track::save( std::ostream& out ) const
+{
+	out.write(TrackFormat::Magic, sizeof(TrackFormat::Magic));
+	TrackFormat::writeLE<uint8_t>(out, TrackFormat::Version);
+	TrackFormat::writeLE<uint8_t>(out, static_cast<uint8_t>(ids.size()));
+	for (auto id: ids) TrackFormat::writeLE<uint8_t>(out, id);
+	TrackFormat::writeLE<uint32_t>(out, static_cast<uint32_t>(frameCount()));
+
+	for (size_t f=0; f<frameCount(); ++f)
+	{
+		TrackFormat::writeLE<uint32_t>(out, timestamps[f]);
+		const int16_t* pos = frame(f);
+		for (size_t c=0; c<ids.size(); ++c)
+		{
+			TrackFormat::writeLE<uint16_t>(out, static_cast<uint16_t>(pos[c]));
+		}
+	}
+
+	if (!out)
+	{
+		throw std::runtime_error("Unable to write track");
+	}
+}
+
+inline void Track::save( const std::string& path ) const
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+	{
+		throw std::runtime_error("Unable to open track file for writing: " + path);
+	}
+	save(out);
+}
+
+inline Track Track::load( std::istream& in )
+{
+	char magic[sizeof(TrackFormat::Magic)] = {};
+	in.read(magic, sizeof(magic));
+	if (!in || !std::equal(magic, magic+sizeof(magic), TrackFormat::Magic))
+	{
+		throw std::runtime_error("Not a Hiwonder track");
+	}
+	if (TrackFormat::readLE<uint8_t>(in) != TrackFormat::Version)
+	{
+		throw std::runtime_error("Unsupported track version");
+	}
+
+	Track track;
+	track.ids.resize(TrackFormat::readLE<uint8_t>(in));
+	for (auto& id: track.ids) id = TrackFormat::readLE<uint8_t>(in);
+
+	// The frame count is not trusted: it must match the bytes left in the stream
+	//     (when seekable), and it never sizes an allocation ahead of the data
+	const uint32_t frames = TrackFormat::readLE<uint32_t>(in);
+	const uint64_t frameBytes = sizeof(uint32_t) + sizeof(uint16_t)*track.ids.size();
+	const auto here = in.tellg();
+	if (here != std::istream::pos_type(-1))
+	{
+		in.seekg(0, std::ios::end);
+		const auto end = in.tellg();
+		in.seekg(here);
+		if (!in || static_cast<uint64_t>(end - here) < frames*frameBytes)
+		{
+			throw std::runtime_error("Unexpected end of track");
+		}
+	}
+	constexpr uint32_t MaxReservedFrames = 4096;
+	track.timestamps.reserve(std::min(frames, MaxReservedFrames));
+	track.positions.reserve(std::min(frames, MaxReservedFrames)*track.ids.size());
+
+	for (uint32_t f=0; f<frames; ++f)
+	{
+		track.timestamps.push_back(TrackFormat::readLE<uint32_t>(in));
+		for (size_t c=0; c<track.ids.size(); ++c)
+		{
+			track.positions.push_back(static_cast<int16_t>(TrackFormat::readLE<uint16_t>(in)));
+		}
+	}
+	return track;
+}
+
+inline Track Track::load( const std::string& path )
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+	{
+		throw std::runtime_error("Unable to open track file: " + path);
+	}
+	return load(in);
+}
+
+inline TrackPlayer::TrackPlayer( std::vector<ServoRef> servos ): m_servos(std::move(servos))
+{
+}
+
+inline TrackPlayer::TrackPlayer( std::vector<ServoRef> servos, const BusTiming& timing ):
+	m_servos(std::move(servos)),
+	m_timing(timing),
+	m_compensate(true)
+{
+}
+
+inline std::vector<size_t> TrackPlayer::mapColumns( const Track& track ) const
+{
+	std::vector<size_t> columns;
+	for (auto id: track.ids)
+	{
+		auto it = std::find_if(m_servos.begin(), m_servos.end(),
+		    [id](const ServoRef& s){ return s.get().getId()==id; });
+		if (it == m_servos.end())
+		{
+			throw std::runtime_error("No servo for track id " + std::to_string(id));
+		}
+		columns.push_back(static_cast<size_t>(it-m_servos.begin()));
+	}
+	return columns;
+}
+
+inline void TrackPlayer::setLeadIn( std::chrono::milliseconds leadIn )
+{
+	if (leadIn.count() < 0 || leadIn.count() > std::numeric_limits<uint16_t>::max())
+	{
+		throw std::runtime_error("TrackPlayer: lead-in out of the moveTimeWrite range");
+	}
+	m_leadIn = leadIn;
+}
+
+inline void TrackPlayer::play( const Track& track ) const
+{
+	const auto columns = mapColumns(track);
+
+	// Reach the start pose at a controlled speed before starting the clock
+	if (track.frameCount() > 0 && m_leadIn.count() > 0)
+	{
+		const int16_t* first = track.frame(0);
+		for (size_t c=0; c<columns.size(); ++c)
+		{
+			m_servos[columns[c]].get().moveTimeWrite(first[c], static_cast<uint16_t>(m_leadIn.count()));
+		}
+		std::this_thread::sleep_for(m_leadIn);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (size_t f=0; f<track.frameCount(); ++f)
+	{
+		std::this_thread::sleep_until(start + std::chrono::microseconds(track.timestamps[f]));
+
+		// Let the servo interpolate until the next frame
+		const uint32_t nextUs = f+1<track.frameCount() ? track.timestamps[f+1] : track.timestamps[f];
+		const uint16_t timeMs = static_cast<uint16_t>((nextUs - track.timestamps[f])/1000u);
+
+		const int16_t* pos = track.frame(f);
+		for (size_t c=0; c<columns.size(); ++c)
+		{
+			int16_t target = pos[c];
+			if (m_compensate)
+			{
+				// Frame <c> of the burst takes effect later than the tick
+				const double effectUs = track.timestamps[f] + m_timing.effectDelayUs(c);
+				target = static_cast<int16_t>(std::lround(track.position(effectUs, c)));
+			}
+			m_servos[columns[c]].get().moveTimeWrite(target, timeMs);
+		}
+	}
+}
+
+}
+#endif //HIWONDER_RPI_TRACK
@@ -0,0 +1,559 @@
+/*
+ * This file is part of HiwonderRPI library
+ *
+ * HiwonderRPI is free software: you can redistribute it and/or modify
+ * it under ther terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HiwonderRPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HiwonderRPI. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Author: Adrian Maire escain (at) gmail.com
+ */
+
+#ifndef HIWONDER_RPI_WAYPOINTS
+#define HIWONDER_RPI_WAYPOINTS
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "HiwonderBusServo.hpp"
+#include "HiwonderBusTiming.hpp"
+
+namespace HiwonderRpi
+{
+
+/// Limits of a joint, in position units (0.24deg)
+struct JointLimits
+{
+	/// Maximal speed in units/s
+	float maxVelocity = 500.0f;
+	/// Maximal acceleration in units/s^2
+	float maxAcceleration = 2000.0f;
+};
+
+/// Queue of waypoints for a group of joints, producing a continuous motion:
+///     the joints move together along straight segments between waypoints, and
+///     the corners are passed without stopping.
+/// Each corner is replaced by a parabolic blend: from a distance r before the
+///     corner to r after it, the velocity of every joint changes linearly from
+///     the incoming to the outgoing direction. The speed at the corner is the
+///     highest speed such that this change fits the acceleration limit of every
+///     joint, and the blend deviates at most Config::cornerDeviation from the
+///     corner ("junction deviation"). Full reversals stop at the corner.
+/// Only the next Config::lookahead waypoints are considered: the motion is
+///     always able to stop at the end of this window, so waypoints can be
+///     pushed while moving.
+class WaypointQueue
+{
+public:
+	struct Config
+	{
+		/// Number of waypoints planned ahead
+		size_t lookahead = 8;
+		/// Largest distance from a corner to the blended path, in position units
+		float cornerDeviation = 5.0f;
+	};
+
+	/// @arg limits: limits of each joint of the group
+	WaypointQueue( std::vector<JointLimits> limits );
+	WaypointQueue( std::vector<JointLimits> limits, const Config& config );
+
+	/// Drop all waypoints and stand still at <position>
+	void reset( const std::vector<float>& position );
+
+	/// Append a waypoint (one position per joint)
+	void push( const std::vector<float>& waypoint );
+
+	/// Number of waypoints not yet reached
+	size_t pending() const;
+
+	/// True when all waypoints are reached
+	bool idle() const;
+
+	/// Move along the path for <dt> seconds
+	/// @return position of each joint
+	const std::vector<float>& advance( float dt );
+
+	/// Current position of each joint
+	const std::vector<float>& position() const;
+
+	/// Current velocity of each joint, in units/s
+	std::vector<float> velocity() const;
+
+	/// Current speed along the path, in units/s
+	float speed() const;
+
+	size_t jointCount() const;
+
+private:
+	struct Segment
+	{
+		std::vector<float> start;
+		/// Unit direction in joint space, and length
+		std::vector<float> direction;
+		float length = 0.0f;
+		/// Path speed and acceleration allowed by the limits of all joints
+		float maxSpeed = 0.0f;
+		float acceleration = 0.0f;
+		/// Largest speed when entering this segment (corner with the previous one)
+		float maxEntrySpeed = 0.0f;
+		/// Blend of the corner with the previous segment: its half length at
+		///     speed v is v*v*blendFactor/2 (0 for a straight line or a stop)
+		float blendFactor = 0.0f;
+	};
+
+	/// Distance from the corner at the start of <seg> to the ends of its blend at <speed>
+	static float blendRadius( const Segment& seg, float speed );
+
+	/// Largest speed allowed at the end of the current segment, given the
+	///     segments in the lookahead window and a stop at the end of it
+	float exitSpeed() const;
+
+	std::vector<JointLimits> m_limits;
+	Config m_config;
+	std::deque<Segment> m_segments;
+	/// End of the last segment, where the next waypoint starts from
+	std::vector<float> m_end;
+	std::vector<float> m_position;
+	/// Travelled distance on the current segment, and path speed
+	float m_progress = 0.0f;
+	float m_speed = 0.0f;
+	/// Blend in progress toward the current segment (m_blendTime > 0): direction
+	///     of the previous segment, half length, duration and elapsed time
+	std::vector<float> m_blendFrom;
+	float m_blendRadius = 0.0f;
+	float m_blendTime = 0.0f;
+	float m_blendElapsed = 0.0f;
+};
+
+
+/// A group of servos moved together by a WaypointQueue: each tick advances the
+///     queue and streams the new setpoint to every servo with moveTimeWrite.
+class JointGroup
+{
+public:
+	using ServoRef = std::reference_wrapper<HiwonderBusServo>;
+
+	/// @arg servos: servos of the group, in the order of the waypoint positions
+	/// @arg limits: limits of each servo
+	JointGroup( std::vector<ServoRef> servos, std::vector<JointLimits> limits );
+	JointGroup( std::vector<ServoRef> servos, std::vector<JointLimits> limits,
+	    const WaypointQueue::Config& config );
+
+	/// Read the servos positions and start from there
+	void start();
+
+	/// Append a waypoint (one position per servo)
+	void push( const std::vector<float>& waypoint );
+
+	/// Compensate the bus latency: each servo gets the setpoint extrapolated to
+	///     the time its command takes effect, given its position in the burst
+	void setBusTiming( const BusTiming& timing );
+
+	/// Advance by <period> and send the setpoints
+	void tick( std::chrono::microseconds period );
+
+	/// Tick at <period> until all waypoints are reached (blocking)
+	void run( std::chrono::microseconds period );
+
+	WaypointQueue& queue();
+
+private:
+	std::vector<ServoRef> m_servos;
+	WaypointQueue m_queue;
+	BusTiming m_timing;
+	bool m_compensate = false;
+};
+
+
+
+
+//*********************************************************
+//                   IMPLEMENTATION
+//*********************************************************
+
+inline WaypointQueue::WaypointQueue( std::vector<JointLimits> limits ):
+	WaypointQueue(std::move(limits), Config())
+{
+}
+
+inline WaypointQueue::WaypointQueue( std::vector<JointLimits> limits, const Config& config ):
+	m_limits(std::move(limits)),
+	m_config(config),
+	m_end(m_limits.size(), 0.0f),
+	m_position(m_limits.size(), 0.0f)
+{
+}
+
+inline void WaypointQueue::reset( const std::vector<float>& position )
+{
+	if (position.size() != jointCount())
+	{
+		throw std::runtime_error("WaypointQueue: wrong number of joints");
+	}
+	m_segments.clear();
+	m_end = position;
+	m_position = position;
+	m_progress = 0.0f;
+	m_speed = 0.0f;
+	m_blendTime = 0.0f;
+}
+
+inline void WaypointQueue::push( const std::vector<float>& waypoint )
+{
+	if (waypoint.size() != jointCount())
+	{
+		throw std::runtime_error("WaypointQueue: wrong number of joints");
+	}
+
+	Segment seg;
+	seg.start = m_end;
+	seg.direction.resize(jointCount());
+	float squared = 0.0f;
+	for (size_t j=0; j<jointCount(); ++j)
+	{
+		seg.direction[j] = waypoint[j] - m_end[j];
+		squared += seg.direction[j]*seg.direction[j];
+	}
+	seg.length = std::sqrt(squared);
+	if (seg.length < 1e-3f) return; // Already there
+
+	// Path limits: the most constrained joint, scaled by its share of the motion
+	seg.maxSpeed = std::numeric_limits<float>::infinity();
+	seg.acceleration = std::numeric_limits<float>::infinity();
+	for (size_t j=0; j<jointCount(); ++j)
+	{
+		seg.direction[j] /= seg.length;
+		const float share = std::abs(seg.direction[j]);
+		if (share < 1e-6f) continue;
+		seg.maxSpeed = std::min(seg.maxSpeed, m_limits[j].maxVelocity/share);
+		seg.acceleration = std::min(seg.acceleration, m_limits[j].maxAcceleration/share);
+	}
+
+	// Corner with the previous segment: cos of the angle between both directions
+	seg.maxEntrySpeed = 0.0f;
+	if (!m_segments.empty())
+	{
+		const Segment& prev = m_segments.back();
+		float cosTurn = 0.0f;
+		for (size_t j=0; j<jointCount(); ++j) cosTurn += prev.direction[j]*seg.direction[j];
+
+		const float limit = std::min(prev.maxSpeed, seg.maxSpeed);
+		if (cosTurn > -0.9999f)
+		{
+			// Blend at speed v over a half length r: joint j changes velocity by
+			//     v*|dj| (dj: change of its direction) in time 2r/v, and the blend
+			//     passes at r*|d|/4 from the corner. With r = v*v*factor/2, the
+			//     factor max(|dj|/aj) keeps every joint within its acceleration.
+			float factor = 0.0f;
+			float change = 0.0f;
+			for (size_t j=0; j<jointCount(); ++j)
+			{
+				const float d = seg.direction[j] - prev.direction[j];
+				change += d*d;
+				factor = std::max(factor, std::abs(d)/m_limits[j].maxAcceleration);
+			}
+			change = std::sqrt(change);
+
+			if (factor*change < 1e-12f)
+			{
+				seg.maxEntrySpeed = limit; // Straight line
+			}
+			else
+			{
+				// Deviation within cornerDeviation, and each blend on at most half of both segments
+				const float deviation = 8.0f*m_config.cornerDeviation/(factor*change);
+				const float fit = std::min(prev.length, seg.length)/factor;
+				seg.maxEntrySpeed = std::min(limit, std::sqrt(std::min(deviation, fit)));
+				seg.blendFactor = factor;
+			}
+		}
+	}
+
+	m_segments.push_back(std::move(seg));
+	m_end = waypoint;
+}
+
+inline size_t WaypointQueue::pending() const
+{
+	return m_segments.size();
+}
+
+inline bool WaypointQueue::idle() const
+{
+	return m_segments.empty();
+}
+
+inline float WaypointQueue::blendRadius( const Segment& seg, float speed )
+{
+	return speed*speed*seg.blendFactor/2.0f;
+}
+
+inline float WaypointQueue::exitSpeed() const
+{
+	// Backward pass over the window: stop at its end, and each segment must
+	//     be able to slow down to the entry speed of the next one on its
+	//     straight part (without the blends, taken at their largest)
+	const size_t window = std::min(m_segments.size(), std::max<size_t>(1, m_config.lookahead));
+	float exit = 0.0f;
+	for (size_t k=window-1; k>0; --k)
+	{
+		const Segment& seg = m_segments[k];
+		const float blendOut = k+1 < window ? blendRadius(m_segments[k+1], m_segments[k+1].maxEntrySpeed) : 0.0f;
+		const float straight = std::max(0.0f, seg.length - blendRadius(seg, seg.maxEntrySpeed) - blendOut);
+		const float entry = std::sqrt(exit*exit + 2.0f*seg.acceleration*straight);
+		exit = std::min(seg.maxEntrySpeed, entry);
+	}
+	return exit;
+}
+
+inline const std::vector<float>& WaypointQueue::advance( float dt )
+{
+	float remaining = dt;
+	while (remaining > 0.0f && !m_segments.empty())
+	{
+		// Blend in progress: constant path speed, the direction changes
+		if (m_blendTime > 0.0f)
+		{
+			const float used = std::min(remaining, m_blendTime - m_blendElapsed);
+			m_blendElapsed += used;
+			remaining -= used;
+			if (m_blendElapsed >= m_blendTime)
+			{
+				m_blendTime = 0.0f;
+				m_progress = m_blendRadius;
+			}
+			continue;
+		}
+
+		const Segment& seg = m_segments.front();
+		const Segment* next = m_segments.size() > 1 ? &m_segments[1] : nullptr;
+		const float a = seg.acceleration;
+		const float t = remaining;
+
+		// Speed at the start of the next blend: it must fit in what is left of the
+		//     segment, and be reachable from the current speed before the blend,
+		//     accelerating (v^2 + 2a(d-r)) or braking (v^2 - 2a(d-r)). A waypoint pushed
+		//     while moving can add a sharp corner close ahead: the blend then only fits
+		//     at a low speed, that braking must still reach (a stop at the corner
+		//     always does, the previous plan ended there).
+		float exit = exitSpeed();
+		float radius = 0.0f;
+		if (next && next->blendFactor > 0.0f)
+		{
+			const float toCorner = seg.length - m_progress;
+			const float k = next->blendFactor;
+			exit = std::min({exit, std::sqrt(2.0f*toCorner/k),
+			    std::sqrt((m_speed*m_speed + 2.0f*a*toCorner)/(1.0f + a*k))});
+			if (a*k > 1.0f)
+			{
+				exit = std::min(exit, std::sqrt(std::max(0.0f, 2.0f*a*toCorner - m_speed*m_speed)/(a*k - 1.0f)));
+			}
+			radius = blendRadius(*next, exit);
+		}
+		const float left = std::max(0.0f, seg.length - m_progress - radius);
+
+		// Fastest speed at the end of this step from which the blend (or the end of
+		//     the segment) can still be reached at <exit> speed: the step (trapezoid)
+		//     plus the braking distance (v^2-exit^2)/2a must fit in <left>
+		const float disc = a*a*t*t - 4.0f*(a*m_speed*t - exit*exit - 2.0f*a*left);
+		const float brake = disc > 0.0f ? (std::sqrt(disc) - a*t)/2.0f : 0.0f;
+		float v = std::min({m_speed + a*t, seg.maxSpeed, brake});
+		v = std::max(v, std::max(0.0f, m_speed - a*t));
+
+		const float step = (m_speed + v)/2.0f*t;
+		if (step >= left)
+		{
+			// Blend (or end of segment) reached within this step, at constant acceleration:
+			//     left = speed*used + accel*used^2/2. Continue on the next one.
+			const float accel = (v - m_speed)/t;
+			float used = left/std::max(m_speed, 1e-6f);
+			if (std::abs(accel) > 1e-6f)
+			{
+				const float root = std::sqrt(std::max(0.0f, m_speed*m_speed + 2.0f*accel*left));
+				used = (root - m_speed)/accel;
+			}
+			used = std::min(t, std::max(0.0f, used));
+			float arrival = m_speed + accel*used;
+			if (arrival > exit && left > 0.0f)
+			{
+				// Too fast for <exit> (the step profile is coarse): brake just enough
+				//     to arrive at <exit>, the previous steps keep this within the limit
+				used = 2.0f*left/(m_speed + exit);
+				if (used > t)
+				{
+					// Not there within this step: keep braking at that rate
+					const float slowed = std::max(exit, m_speed - (m_speed*m_speed - exit*exit)/(2.0f*left)*t);
+					m_progress += (m_speed + slowed)/2.0f*t;
+					m_speed = slowed;
+					remaining = 0.0f;
+					continue;
+				}
+				arrival = exit;
+			}
+			remaining -= used;
+			m_speed = std::min(arrival, exit);
+			m_progress = 0.0f;
+
+			// A blend started below <exit> speed keeps the radius of <exit>: it takes
+			//     longer, with a lower acceleration
+			if (radius > 0.0f && m_speed > 1e-3f)
+			{
+				m_blendFrom = seg.direction;
+				m_blendRadius = radius;
+				m_blendTime = 2.0f*radius/m_speed;
+				m_blendElapsed = 0.0f;
+			}
+			m_segments.pop_front();
+			continue;
+		}
+
+		m_progress += step;
+		m_speed = v;
+		remaining = 0.0f;
+	}
+
+	if (m_segments.empty())
+	{
+		m_position = m_end;
+		m_speed = 0.0f;
+		m_blendTime = 0.0f;
+	}
+	else if (m_blendTime > 0.0f)
+	{
+		// p = corner - r*d1 + v*d1*t + v*(d2-d1)*t^2/(2T)
+		const Segment& seg = m_segments.front();
+		const float t = m_blendElapsed;
+		for (size_t j=0; j<jointCount(); ++j)
+		{
+			const float d1 = m_blendFrom[j];
+			const float d2 = seg.direction[j];
+			m_position[j] = seg.start[j] - m_blendRadius*d1 + m_speed*d1*t
+			    + m_speed*(d2 - d1)*t*t/(2.0f*m_blendTime);
+		}
+	}
+	else
+	{
+		const Segment& seg = m_segments.front();
+		for (size_t j=0; j<jointCount(); ++j)
+		{
+			m_position[j] = seg.start[j] + seg.direction[j]*m_progress;
+		}
+	}
+	return m_position;
+}
+
+inline const std::vector<float>& WaypointQueue::position() const
+{
+	return m_position;
+}
+
+inline std::vector<float> WaypointQueue::velocity() const
+{
+	std::vector<float> result(jointCount(), 0.0f);
+	if (m_segments.empty()) return result;
+	const float blend = m_blendTime > 0.0f ? m_blendElapsed/m_blendTime : 1.0f;
+	for (size_t j=0; j<jointCount(); ++j)
+	{
+		const float d2 = m_segments.front().direction[j];
+		const float d1 = m_blendTime > 0.0f ? m_blendFrom[j] : d2;
+		result[j] = (d1 + (d2 - d1)*blend)*m_speed;
+	}
+	return result;
+}
+
+inline float WaypointQueue::speed() const
+{
+	return m_speed;
+}
+
+inline size_t WaypointQueue::jointCount() const
+{
+	return m_limits.size();
+}
+
+inline JointGroup::JointGroup( std::vector<ServoRef> servos, std::vector<JointLimits> limits ):
+	JointGroup(std::move(servos), std::move(limits), WaypointQueue::Config())
+{
+}
+
+inline JointGroup::JointGroup( std::vector<ServoRef> servos, std::vector<JointLimits> limits,
+    const WaypointQueue::Config& config ):
+	m_servos(std::move(servos)),
+	m_queue(std::move(limits), config)
+{
+	if (m_servos.size() != m_queue.jointCount())
+	{
+		throw std::runtime_error("JointGroup: one limit per servo expected");
+	}
+}
+
+inline void JointGroup::start()
+{
+	std::vector<float> position;
+	for (auto& servo: m_servos) position.push_back(servo.get().posRead());
+	m_queue.reset(position);
+}
+
+inline void JointGroup::push( const std::vector<float>& waypoint )
+{
+	m_queue.push(waypoint);
+}
+
+inline void JointGroup::tick( std::chrono::microseconds period )
+{
+	const auto& position = m_queue.advance(std::chrono::duration<float>(period).count());
+	const auto velocity = m_compensate ? m_queue.velocity() : std::vector<float>();
+
+	// The servo interpolates toward the setpoint during the period
+	const auto timeMs = static_cast<uint16_t>(period.count()/1000);
+	for (size_t j=0; j<m_servos.size(); ++j)
+	{
+		float target = position[j];
+		if (m_compensate)
+		{
+			target += velocity[j]*static_cast<float>(m_timing.effectDelayUs(j)*1e-6);
+		}
+		m_servos[j].get().moveTimeWrite(static_cast<int16_t>(std::lround(target)), timeMs);
+	}
+}
+
+inline void JointGroup::setBusTiming( const BusTiming& timing )
+{
+	m_timing = timing;
+	m_compensate = true;
+}
+
+inline void JointGroup::run( std::chrono::microseconds period )
+{
+	auto next = std::chrono::steady_clock::now();
+	while (!m_queue.idle())
+	{
+		next += period;
+		tick(period);
+		std::this_thread::sleep_until(next);
+	}
+}
+
+inline WaypointQueue& JointGroup::queue()
+{
+	return m_queue;
+}
+
+}
+#endif //HIWONDER_RPI_WAYPOINTS
@@ -17,10 +17,15 @@
  * Author: Adrian Maire escain (at) gmail.com
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
 #include <iostream>
 #include <string>
 #include <functional>
 #include <list>
+#include <vector>
 
 /*
  * Create tests in the following way:
@@ -35,6 +40,13 @@
  *
  * You may use the constructor to setup element, and use
  * Base member in your tests.
+ *
+ * Benchmarks use the Benchmark base class:
+ * UNIT_TEST(NameOfTheBenchmark, Benchmark)
+ * {
+ *     auto result = measure("myFunction", 1000, []{ myFunction(); });
+ *     ASSERT_PERCENTILE_FASTER_THAN(result, 99, std::chrono::microseconds(50));
+ * }
  */
 
 //*-----------------------------------------------------------------------
@@ -83,26 +95,153 @@ std::list<std::pair<std::string, Registry::factoryMethod>> Registry::registry;
 	    return;                                              \
 	}
 
+// Arguments of ASSERT_EQ and ASSERT_NEQ are evaluated only once
 #define ASSERT_EQ(a,b)                                       \
-	if(a!=b)                                                 \
+	do                                                       \
 	{                                                        \
-	    std::cout << "    " << __LINE__ << " FAIL EQ: "      \
-	        << getName() << " : " << #a << "("<< a <<        \
-	        ") != "<<#b <<"(" <<b<<")" << std::endl;         \
-	    setFail();                                           \
-	    return;                                              \
-	}
+	    const auto& _ut_a = (a);                             \
+	    const auto& _ut_b = (b);                             \
+	    if(_ut_a!=_ut_b)                                     \
+	    {                                                    \
+	        std::cout << "    " << __LINE__ << " FAIL EQ: "  \
+	            << getName() << " : " << #a << "("<< _ut_a   \
+	            << ") != "<<#b <<"(" <<_ut_b<<")"<<std::endl;\
+	        setFail();                                       \
+	        return;                                          \
+	    }                                                    \
+	} while(0)
 
 #define ASSERT_NEQ(a,b)                                      \
-	if(a!=b)                                                 \
+	do                                                       \
 	{                                                        \
-	    std::cout << "    " << __LINE__ << " FAIL NEQ: "     \
-	        << getName() << " : " << #a << "("<< a <<        \
-	        ") == "<<#b <<"(" <<b<<")" << std::endl;         \
-	    setFail();                                           \
-	    return;                                              \
+	    const auto& _ut_a = (a);                             \
+	    const auto& _ut_b = (b);                             \
+	    if(_ut_a==_ut_b)                                     \
+	    {                                                    \
+	        std::cout << "    " << __LINE__ << " FAIL NEQ: " \
+	            << getName() << " : " << #a << "("<< _ut_a   \
+	            << ") == "<<#b <<"(" <<_ut_b<<")"<<std::endl;\
+	        setFail();                                       \
+	        return;                                          \
+	    }                                                    \
+	} while(0)
+
+/// Run <expr> once, fail if it takes longer than <budget> (a std::chrono duration)
+#define ASSERT_FASTER_THAN(expr, budget)                     \
+	do                                                       \
+	{                                                        \
+	    const auto _ut_start=std::chrono::steady_clock::now();\
+	    expr;                                                \
+	    const auto _ut_elapsed =                             \
+	        std::chrono::steady_clock::now() - _ut_start;    \
+	    if(_ut_elapsed > (budget))                           \
+	    {                                                    \
+	        std::cout << "    " << __LINE__ << " FAIL TIME: "\
+	            << getName() << " : " << #expr << " took "   \
+	            << std::chrono::duration<double,std::micro>( \
+	                _ut_elapsed).count() << "us > " << #budget\
+	            << std::endl;                                \
+	        setFail();                                       \
+	        return;                                          \
+	    }                                                    \
+	} while(0)
+
+/// Fail if the <pct> percentile of a BenchmarkResult is above <budget>
+#define ASSERT_PERCENTILE_FASTER_THAN(result, pct, budget)   \
+	do                                                       \
+	{                                                        \
+	    const auto& _ut_r = (result);                        \
+	    const double _ut_p = _ut_r.percentile(pct);          \
+	    const double _ut_budget = std::chrono::duration<     \
+	        double,std::nano>(budget).count();               \
+	    if(_ut_p > _ut_budget)                               \
+	    {                                                    \
+	        std::cout << "    " << __LINE__ << " FAIL TIME: "\
+	            << getName() << " : " << _ut_r.name << " p" \
+	            << (pct) << " " << _ut_p/1000.0 << "us > "   \
+	            << #budget << std::endl;                     \
+	        setFail();                                       \
+	        return;                                          \
+	    }                                                    \
+	} while(0)
+
+
+//*-------------------------------------------------------------------------
+/// Result of repeated time measurements
+struct BenchmarkResult
+{
+	std::string name;
+	std::vector<double> samples; /// duration of each sample in ns, sorted
+
+	/// Sample duration at percentile <pct> in [0,100], in ns (nearest rank)
+	double percentile(double pct) const
+	{
+		if (samples.empty()) return 0.0;
+		const double rank = std::ceil(pct/100.0*samples.size());
+		const size_t index = static_cast<size_t>(std::max(1.0, rank))-1;
+		return samples[std::min(index, samples.size()-1)];
 	}
 
+	/// Mean sample duration in ns
+	double mean() const
+	{
+		double sum = 0.0;
+		for (auto s: samples) sum += s;
+		return samples.empty() ? 0.0 : sum/samples.size();
+	}
+
+	/// Print a one-line summary, in microseconds
+	void print() const
+	{
+		std::cout << "    BENCH " << name << ": n=" << samples.size()
+		    << " mean=" << mean()/1000.0 << "us"
+		    << " min=" << percentile(0)/1000.0 << "us"
+		    << " p50=" << percentile(50)/1000.0 << "us"
+		    << " p90=" << percentile(90)/1000.0 << "us"
+		    << " p99=" << percentile(99)/1000.0 << "us"
+		    << " max=" << percentile(100)/1000.0 << "us" << std::endl;
+	}
+};
+
+/// Base class for benchmark tests, see UNIT_TEST(name, Benchmark)
+class Benchmark
+{
+public:
+	/// Measure <fn>: run it <warmup> times, then take <count> samples.
+	/// Each sample times <batch> consecutive calls, and is divided by <batch>
+	///     (use batch>1 for functions close to the clock resolution).
+	/// The result is printed.
+	template <typename F>
+	BenchmarkResult measure(const std::string& name, size_t count, F&& fn,
+	    size_t batch=1, size_t warmup=10)
+	{
+		using Clock = std::chrono::steady_clock;
+		for (size_t i=0; i<warmup; ++i) fn();
+
+		BenchmarkResult result;
+		result.name = name;
+		result.samples.reserve(count);
+		for (size_t i=0; i<count; ++i)
+		{
+			const auto start = Clock::now();
+			for (size_t b=0; b<batch; ++b) fn();
+			const auto elapsed = Clock::now() - start;
+			result.samples.push_back(
+			    std::chrono::duration<double,std::nano>(elapsed).count()/batch);
+		}
+		std::sort(result.samples.begin(), result.samples.end());
+		result.print();
+		return result;
+	}
+
+	/// Prevent the compiler from optimizing away the computation of <value>
+	template <typename T>
+	static void keep(const T& value)
+	{
+		asm volatile("" : : "r,m"(value) : "memory");
+	}
+};
+
 
 //*-------------------------------------------------------------------------
 #define REGISTER_CLASS(ClassType)                            \
@@ -170,7 +309,21 @@ int main()
 		auto* obj = constructor();
 
 		std::cout << "    RUNNING: " << obj->getName() << std::endl;
-		obj->run();
+		try
+		{
+			obj->run();
+		}
+		catch(const std::exception& e)
+		{
+			// A test that throws fails, the next ones still run
+			std::cout << "EXCEPTION: " << e.what() << std::endl;
+			obj->setFail();
+		}
+		catch(...)
+		{
+			std::cout << "EXCEPTION: unknown" << std::endl;
+			obj->setFail();
+		}
 		if (!obj->isPassed())
 		{
 			std::cout << "FAILED: " << obj->getName() << std::endl;
@@ -188,5 +341,5 @@ int main()
 		std::cout << "FAILED: " << countPassed << " passed of " << count << std::endl;
 	}
 
-	return 0;
+	return count == countPassed ? 0 : 1;
 }
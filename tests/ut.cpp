@@ -17,17 +17,30 @@
  * Author: Adrian Maire escain (at) gmail.com
  */
 
+#include <algorithm>
+#include <functional>
+#include <sstream>
 #include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "HiwonderBake.hpp"
 #include "HiwonderBusServo.hpp"
+#include "HiwonderBusTiming.hpp"
+#include "HiwonderHealth.hpp"
+#include "HiwonderOdometry.hpp"
+#include "HiwonderRobot.hpp"
+#include "HiwonderWaypoints.hpp"
+#include "HiwonderTrack.hpp"
 #include "UnitTest.hpp"
 
 constexpr static uint8_t id=1;
 
 UNIT_TEST(test_have_root_privileges)
 {
-	ASSERT_EQ( getuid(), 0 );
+	ASSERT_EQ( getuid(), 0u );
 }
 
 UNIT_TEST(message_ensure_servo_id_is_1)
@@ -417,3 +430,779 @@ UNIT_TEST(ledError_read_and_write_match)
 
 	servo.ledErrorWrite(true,true,true);
 }
+
+UNIT_TEST(track_save_and_load_match)
+{
+	HiwonderRpi::Track track;
+	track.ids = {1, 2, 3};
+	const int16_t frame0[] = {0, 500, 1000};
+	const int16_t frame1[] = {-5, 501, 999};
+	track.addFrame(0, frame0);
+	track.addFrame(4250, frame1);
+	
+	std::stringstream stream;
+	track.save(stream);
+	const auto loaded = HiwonderRpi::Track::load(stream);
+	
+	ASSERT(loaded.ids == track.ids);
+	ASSERT(loaded.timestamps == track.timestamps);
+	ASSERT(loaded.positions == track.positions);
+	ASSERT_EQ(loaded.frame(1)[0], -5);
+	ASSERT_EQ(loaded.duration(), 4250u);
+}
+
+UNIT_TEST(track_load_rejects_invalid_data)
+{
+	bool throwed=false;
+	try
+	{
+		std::stringstream stream("not a track");
+		HiwonderRpi::Track::load(stream);
+	}catch(const std::runtime_error&)
+	{
+		throwed=true;
+	}
+	ASSERT(throwed);
+	
+	// Header announcing 2^32-1 frames of 18 servos, followed by a few bytes
+	std::string header("HWTK\x01\x12", 6);
+	for (uint8_t id=1; id<=18; ++id) header += static_cast<char>(id);
+	header += std::string(4, '\xFF') + "garbage";
+	std::stringstream seekable(header);
+	throwed=false;
+	try
+	{
+		HiwonderRpi::Track::load(seekable);
+	}catch(const std::runtime_error&)
+	{
+		throwed=true;
+	}
+	ASSERT(throwed);
+}
+
+UNIT_TEST(wheelOdometry_unwraps_through_dead_zone)
+{
+	HiwonderRpi::WheelOdometry::Config config;
+	config.calibrationRate = 0.0f;
+	config.measurementWeight = 1.0f;
+	HiwonderRpi::WheelOdometry wheel(config);
+	
+	// 150 units/s at speed 100; dt=1s: 900 -> 1050(dead) -> 1200(dead) -> 1350=-150 -> 0
+	wheel.reset(900);
+	wheel.update(1050, 100, 1.0f);
+	wheel.update(-300, 100, 1.0f);   // garbage reading in the dead zone
+	wheel.update(1400, 100, 1.0f);   // garbage reading in the dead zone
+	wheel.update(0, 100, 1.0f);
+	ASSERT(std::abs(wheel.travel()-600.0f) < 0.01f);
+	
+	// Readings win over an inexact prediction
+	wheel.update(200, 100, 1.0f);
+	ASSERT(std::abs(wheel.travel()-800.0f) < 0.01f);
+}
+
+UNIT_TEST(wheelOdometry_reset_in_dead_zone_anchors_on_first_valid_reading)
+{
+	HiwonderRpi::WheelOdometry::Config config;
+	config.calibrationRate = 0.0f;
+	config.measurementWeight = 1.0f;
+	HiwonderRpi::WheelOdometry wheel(config);
+	
+	// The wheel rests at 1350 but reads garbage in the dead zone; 75 units per update
+	wheel.reset(1100);
+	wheel.update(1200, 50, 1.0f);   // 1425, garbage
+	wheel.update(0, 50, 1.0f);      // 1500=0, the angle is anchored here
+	ASSERT(std::abs(wheel.travel()-150.0f) < 0.01f);
+	wheel.update(75, 50, 1.0f);
+	ASSERT(std::abs(wheel.travel()-225.0f) < 0.01f);
+}
+
+UNIT_TEST(wheelOdometry_calibrates_speed_factor)
+{
+	HiwonderRpi::WheelOdometry::Config config;
+	config.unitsPerSecondPerSpeed = 1.0f;
+	config.calibrationRate = 0.5f;
+	HiwonderRpi::WheelOdometry wheel(config);
+	
+	// Real factor is 2 units/s per speed unit
+	int16_t raw = 0;
+	wheel.reset(raw);
+	for (int i=0; i<30; ++i)
+	{
+		raw = static_cast<int16_t>((raw + 20)%1500);
+		wheel.update(raw, 100, 0.1f);
+	}
+	ASSERT(std::abs(wheel.speedFactor()-2.0f) < 0.05f);
+	ASSERT(std::abs(wheel.travel()-600.0f) < 5.0f);
+}
+
+UNIT_TEST(differentialDrive_integrate_pose)
+{
+	using Odometry = HiwonderRpi::DifferentialDriveOdometry;
+	constexpr float Pi = 3.14159265358979f;
+	
+	Odometry::Pose pose;
+	pose = Odometry::integrate(pose, 1.0f, 1.0f, 0.2f);
+	ASSERT(std::abs(pose.x-1.0f) < 1e-5f && std::abs(pose.y) < 1e-5f && std::abs(pose.theta) < 1e-5f);
+	
+	// Spin in place by a quarter turn
+	const float quarter = Pi/2.0f*0.1f;
+	pose = Odometry::integrate(pose, -quarter, quarter, 0.2f);
+	ASSERT(std::abs(pose.x-1.0f) < 1e-5f && std::abs(pose.theta-Pi/2.0f) < 1e-5f);
+	
+	pose = Odometry::integrate(pose, 0.5f, 0.5f, 0.2f);
+	ASSERT(std::abs(pose.x-1.0f) < 1e-5f && std::abs(pose.y-0.5f) < 1e-5f);
+}
+
+UNIT_TEST(health_score_penalizes_failures_and_ranks)
+{
+	using Transaction = HiwonderRpi::HiwonderBusServo::Transaction;
+	HiwonderRpi::HealthMonitor monitor;
+	
+	// Attached servos keep a pointer to the monitor: it can not be relocated
+	static_assert(!std::is_copy_constructible<HiwonderRpi::HealthMonitor>::value &&
+	    !std::is_move_constructible<HiwonderRpi::HealthMonitor>::value, "monitor is pinned");
+	
+	for (int i=0; i<100; ++i)
+	{
+		monitor.onTransaction(1, Transaction::Ok, 1500);
+		monitor.onTransaction(2, i%10 ? Transaction::Ok : Transaction::Timeout, 1500);
+	}
+	
+	ASSERT_EQ(monitor.score(1), 100.0f);
+	ASSERT(monitor.score(2) < 70.0f);
+	ASSERT(!monitor.isFlaky(1));
+	ASSERT(monitor.isFlaky(2));
+	
+	const auto ranking = monitor.rankByHealth();
+	ASSERT_EQ(ranking.size(), 2u);
+	ASSERT_EQ((int)ranking[0], 1);
+	
+	// A tracking error below nominal costs nothing
+	monitor.reportTrackingError(1, 5.0f);
+	ASSERT_EQ(monitor.score(1), 100.0f);
+}
+
+UNIT_TEST(health_history_persists_and_gives_trend)
+{
+	using Transaction = HiwonderRpi::HiwonderBusServo::Transaction;
+	std::stringstream history(
+	    "# id run score latencyUs timeoutRate corruptedRate tempHeadroom vinHeadroom trackingError\n"
+	    "3 1 100 1500 0 0 nan nan nan\n"
+	    "3 2 95 1800 0.0125 0 nan nan nan\n");
+	
+	HiwonderRpi::HealthMonitor monitor;
+	monitor.load(history);
+	ASSERT_EQ(monitor.history().size(), 2u);
+	ASSERT(std::isnan(monitor.history()[0].tempHeadroom));
+	
+	for (int i=0; i<40; ++i)
+	{
+		monitor.onTransaction(3, i%20 ? Transaction::Ok : Transaction::Timeout, 2100);
+	}
+	const auto trend = monitor.trend(3);
+	ASSERT(trend.scorePerRun < 0.0f);
+	ASSERT(trend.latencyUsPerRun > 0.0f);
+	
+	std::stringstream saved;
+	monitor.save(saved);
+	HiwonderRpi::HealthMonitor reloaded;
+	reloaded.load(saved);
+	ASSERT_EQ(reloaded.history().size(), 3u);
+	ASSERT_EQ(reloaded.history()[2].run, 3u);
+	ASSERT(std::abs(reloaded.history()[2].score - monitor.score(3)) < 0.01f);
+}
+
+UNIT_TEST(assert_macros_evaluate_arguments_once)
+{
+	int calls = 0;
+	auto next = [&calls](){ return ++calls; };
+	
+	ASSERT_EQ(next(), 1);
+	ASSERT_NEQ(next(), 1);
+	ASSERT_EQ(calls, 2);
+	ASSERT_FASTER_THAN(next(), std::chrono::seconds(1));
+	ASSERT_EQ(calls, 3);
+}
+
+UNIT_TEST(benchmark_percentiles_are_ordered, Benchmark)
+{
+	auto result = measure("noop", 100, []{ Benchmark::keep(0); });
+	ASSERT_EQ(result.samples.size(), 100u);
+	ASSERT(result.percentile(0) <= result.percentile(50));
+	ASSERT(result.percentile(50) <= result.percentile(99));
+	ASSERT(result.percentile(99) <= result.percentile(100));
+}
+
+UNIT_TEST(bench_track_save_and_load, Benchmark)
+{
+	// One minute of a 18 servos robot at 50Hz
+	HiwonderRpi::Track track;
+	for (uint8_t id=1; id<=18; ++id) track.ids.push_back(id);
+	std::vector<int16_t> frame(18, 500);
+	for (uint32_t f=0; f<3000; ++f) track.addFrame(f*20000, frame.data());
+	
+	auto result = measure("track save+load 3000x18", 20, [&track]
+	{
+		std::stringstream stream;
+		track.save(stream);
+		Benchmark::keep(HiwonderRpi::Track::load(stream).frameCount());
+	});
+	ASSERT_PERCENTILE_FASTER_THAN(result, 90, std::chrono::milliseconds(100));
+}
+
+UNIT_TEST(bench_wheelOdometry_update, Benchmark)
+{
+	HiwonderRpi::WheelOdometry wheel;
+	wheel.reset(0);
+	int16_t raw = 0;
+	
+	auto result = measure("wheelOdometry update", 200, [&]
+	{
+		raw = static_cast<int16_t>((raw + 15)%1500);
+		wheel.update(raw, 100, 0.01f);
+	}, 100);
+	Benchmark::keep(wheel.travel());
+	ASSERT_PERCENTILE_FASTER_THAN(result, 99, std::chrono::microseconds(5));
+}
+
+UNIT_TEST(bench_health_onTransaction, Benchmark)
+{
+	using Transaction = HiwonderRpi::HiwonderBusServo::Transaction;
+	HiwonderRpi::HealthMonitor monitor;
+	
+	auto result = measure("health onTransaction", 200, [&monitor]
+	{
+		monitor.onTransaction(1, Transaction::Ok, 1500);
+	}, 100);
+	ASSERT_PERCENTILE_FASTER_THAN(result, 99, std::chrono::microseconds(5));
+}
+
+UNIT_TEST(waypointQueue_does_not_stop_on_collinear_waypoints)
+{
+	HiwonderRpi::JointLimits limits;
+	limits.maxVelocity = 500.0f;
+	limits.maxAcceleration = 2000.0f;
+	HiwonderRpi::WaypointQueue queue({limits});
+	queue.reset({0.0f});
+	queue.push({200.0f});
+	queue.push({400.0f});
+	queue.push({600.0f});
+	
+	float minSpeedInside = 1e9f;
+	float previousSpeed = 0.0f;
+	for (int i=0; i<200 && !queue.idle(); ++i)
+	{
+		const float pos = queue.advance(0.01f)[0];
+		ASSERT(queue.speed() <= limits.maxVelocity + 1e-3f);
+		ASSERT(std::abs(queue.speed() - previousSpeed) <= limits.maxAcceleration*0.01f + 1e-3f);
+		previousSpeed = queue.speed();
+		if (pos > 150.0f && pos < 450.0f) minSpeedInside = std::min(minSpeedInside, queue.speed());
+	}
+	ASSERT(queue.idle());
+	ASSERT_EQ(queue.position()[0], 600.0f);
+	ASSERT(minSpeedInside > 0.99f*limits.maxVelocity);
+}
+
+UNIT_TEST(waypointQueue_blends_corners_within_limits)
+{
+	HiwonderRpi::JointLimits limits;
+	HiwonderRpi::WaypointQueue queue({limits, limits});
+	queue.reset({0.0f, 0.0f});
+	queue.push({300.0f, 0.0f});
+	queue.push({300.0f, 300.0f});
+	
+	// Corner reached with a reduced, but non null, speed, on a blend that cuts the
+	//     corner by at most cornerDeviation
+	float cornerSpeed = -1.0f;
+	float cornerDistance = 1e9f;
+	for (int i=0; i<5000 && !queue.idle(); ++i)
+	{
+		const auto before = queue.pending();
+		const auto& position = queue.advance(0.0005f);
+		if (before == 2 && queue.pending() == 1) cornerSpeed = queue.speed();
+		cornerDistance = std::min(cornerDistance, std::hypot(position[0]-300.0f, position[1]));
+	}
+	ASSERT(cornerSpeed > 0.0f);
+	ASSERT(cornerDistance > 1.0f);
+	ASSERT(cornerDistance <= HiwonderRpi::WaypointQueue::Config().cornerDeviation + 0.1f);
+	ASSERT(cornerSpeed < limits.maxVelocity);
+	ASSERT(queue.idle());
+	ASSERT_EQ(queue.position()[0], 300.0f);
+	ASSERT_EQ(queue.position()[1], 300.0f);
+	
+	// A full reversal must stop (then re-accelerate during the rest of the tick)
+	queue.push({300.0f, 0.0f});
+	queue.push({300.0f, 300.0f});
+	for (int i=0; i<500 && !queue.idle(); ++i)
+	{
+		const auto before = queue.pending();
+		queue.advance(0.005f);
+		if (before == 2 && queue.pending() == 1)
+		{
+			ASSERT(queue.speed() <= limits.maxAcceleration*0.005f + 1e-3f);
+		}
+	}
+}
+
+UNIT_TEST(waypointQueue_corners_respect_joint_limits)
+{
+	// Paths streamed at 20ms: the velocity of each joint, from its setpoints,
+	//     must not change faster than its acceleration limit. <feed> is called
+	//     before each tick, to push waypoints while moving.
+	constexpr float dt = 0.02f;
+	auto withinLimits = [](HiwonderRpi::WaypointQueue& queue,
+	    const std::vector<HiwonderRpi::JointLimits>& joints, const std::function<void()>& feed)
+	{
+		std::vector<float> previous = queue.position();
+		std::vector<float> previousVelocity(joints.size(), 0.0f);
+		for (int ticks=0; ticks<10000; ++ticks)
+		{
+			feed();
+			if (queue.idle()) return true;
+			const auto& position = queue.advance(dt);
+			for (size_t j=0; j<joints.size(); ++j)
+			{
+				const float velocity = (position[j] - previous[j])/dt;
+				if (std::abs(velocity) > joints[j].maxVelocity*1.01f) return false;
+				if (std::abs(velocity - previousVelocity[j])/dt > joints[j].maxAcceleration*1.01f) return false;
+				previousVelocity[j] = velocity;
+				previous[j] = position[j];
+			}
+		}
+		return false;
+	};
+	
+	// Random 3-joint path pushed at once
+	HiwonderRpi::JointLimits limits;
+	HiwonderRpi::JointLimits slow;
+	slow.maxVelocity = 200.0f;
+	slow.maxAcceleration = 800.0f;
+	const std::vector<HiwonderRpi::JointLimits> joints = {limits, limits, slow};
+	HiwonderRpi::WaypointQueue queue(joints);
+	queue.reset({500.0f, 500.0f, 500.0f});
+	
+	uint32_t seed = 12345;
+	auto random = [&seed]{ seed = seed*1103515245u + 12345u; return static_cast<float>((seed>>8)%1000); };
+	for (int i=0; i<30; ++i) queue.push({random(), random(), random()});
+	ASSERT(withinLimits(queue, joints, []{}));
+	
+	// Waypoints pushed while moving, two ahead: a corner can show up close to
+	//     the current position, while the previous plan was stopping there
+	HiwonderRpi::JointLimits first;
+	first.maxVelocity = 533.0f;
+	first.maxAcceleration = 957.0f;
+	HiwonderRpi::JointLimits second;
+	second.maxVelocity = 775.0f;
+	second.maxAcceleration = 1623.0f;
+	const std::vector<HiwonderRpi::JointLimits> pair = {first, second};
+	const std::vector<std::vector<float>> path = {{476,504}, {996,605}, {258,878}, {756,715},
+	    {461,296}, {531,321}, {197,388}, {192,403}, {441,512}, {148,387}};
+	HiwonderRpi::WaypointQueue streamed(pair);
+	streamed.reset({500.0f, 500.0f});
+	size_t next = 0;
+	ASSERT(withinLimits(streamed, pair, [&]
+	{
+		while (streamed.pending() < 2 && next < path.size()) streamed.push(path[next++]);
+	}));
+	ASSERT_EQ(next, path.size());
+}
+
+UNIT_TEST(waypointQueue_blending_is_faster_than_stop_and_go)
+{
+	HiwonderRpi::JointLimits limits;
+	const std::vector<std::vector<float>> path = {{200,100}, {400,300}, {500,600}, {300,800}};
+	
+	auto duration = [&](size_t lookahead)
+	{
+		HiwonderRpi::WaypointQueue::Config config;
+		config.lookahead = lookahead;
+		HiwonderRpi::WaypointQueue queue({limits, limits}, config);
+		queue.reset({0.0f, 0.0f});
+		for (const auto& p: path) queue.push(p);
+		int ticks = 0;
+		while (!queue.idle() && ticks < 10000) { queue.advance(0.001f); ++ticks; }
+		return ticks;
+	};
+	
+	// Lookahead of one waypoint stops at every waypoint
+	ASSERT(duration(8) < duration(1));
+}
+
+/// Choreography used by the baking tests: some trigonometry per joint and tick
+static void waveChoreography(double t, int16_t* positions)
+{
+	for (int j=0; j<18; ++j)
+	{
+		positions[j] = static_cast<int16_t>(500.0 + 300.0*std::sin(2.0*t + j*0.3)*std::cos(0.5*t));
+	}
+}
+
+UNIT_TEST(trackBaker_parallel_matches_sequential)
+{
+	std::vector<uint8_t> ids;
+	for (uint8_t id=1; id<=18; ++id) ids.push_back(id);
+	
+	HiwonderRpi::TrackBaker::Config config;
+	config.segmentFrames = 7;
+	config.threads = 1;
+	const auto sequential = HiwonderRpi::TrackBaker(config).bake(ids, std::chrono::seconds(2), waveChoreography);
+	config.threads = 4;
+	const auto parallel = HiwonderRpi::TrackBaker(config).bake(ids, std::chrono::seconds(2), waveChoreography);
+	
+	ASSERT_EQ(sequential.frameCount(), 101u);
+	ASSERT_EQ(sequential.duration(), 2000000u);
+	ASSERT(parallel.timestamps == sequential.timestamps);
+	ASSERT(parallel.positions == sequential.positions);
+	ASSERT(parallel.ids == ids);
+	
+	// The last frame is at the duration, also off the period
+	config.period = std::chrono::milliseconds(30);
+	const auto offPeriod = HiwonderRpi::TrackBaker(config).bake(ids, std::chrono::seconds(1), waveChoreography);
+	ASSERT_EQ(offPeriod.frameCount(), 35u);
+	ASSERT_EQ(offPeriod.timestamps[33], 990000u);
+	ASSERT_EQ(offPeriod.duration(), 1000000u);
+}
+
+UNIT_TEST(trackBaker_rethrows_choreography_errors)
+{
+	bool throwed=false;
+	try
+	{
+		HiwonderRpi::TrackBaker::Config config;
+		config.threads = 3;
+		config.segmentFrames = 4;
+		HiwonderRpi::TrackBaker(config).bake({1}, std::chrono::seconds(1), [](double t, int16_t* p)
+		{
+			if (t > 0.5) throw std::runtime_error("kinematics failed");
+			p[0] = 0;
+		});
+	}catch(const std::runtime_error&)
+	{
+		throwed=true;
+	}
+	ASSERT(throwed);
+	
+	// Timestamps are 32 bits of microseconds
+	const HiwonderRpi::TrackBaker baker;
+	for (auto duration: {std::chrono::microseconds(-1), std::chrono::microseconds(1ll<<32)})
+	{
+		throwed = false;
+		try
+		{
+			baker.bake({1}, duration, [](double, int16_t* p){ p[0] = 0; });
+		}catch(const std::runtime_error&)
+		{
+			throwed=true;
+		}
+		ASSERT(throwed);
+	}
+}
+
+UNIT_TEST(trackBaker_single_thread_bakes_stateful_trajectory)
+{
+	// A waypoint path is not a function of time: advance it on each frame, in order
+	HiwonderRpi::JointLimits limits;
+	const std::vector<std::vector<float>> path = {{200,100}, {400,300}, {500,600}, {300,800}};
+	auto makeQueue = [&]
+	{
+		HiwonderRpi::WaypointQueue queue({limits, limits});
+		queue.reset({0.0f, 0.0f});
+		for (const auto& p: path) queue.push(p);
+		return queue;
+	};
+	
+	HiwonderRpi::WaypointQueue baked = makeQueue();
+	double last = 0.0;
+	HiwonderRpi::TrackBaker::Config config;
+	config.threads = 1;
+	config.segmentFrames = 16;
+	const auto track = HiwonderRpi::TrackBaker(config).bake({1, 2}, std::chrono::seconds(3), [&](double t, int16_t* p)
+	{
+		const auto& position = baked.advance(static_cast<float>(t - last));
+		last = t;
+		for (size_t j=0; j<2; ++j) p[j] = static_cast<int16_t>(std::lround(position[j]));
+	});
+	
+	// Same setpoints as streaming the queue at the bake period
+	HiwonderRpi::WaypointQueue streamed = makeQueue();
+	bool match = true;
+	for (size_t f=0; f<track.frameCount(); ++f)
+	{
+		const auto& position = streamed.advance(f ? 0.02f : 0.0f);
+		for (size_t j=0; j<2; ++j) match = match && track.frame(f)[j] == std::lround(position[j]);
+	}
+	ASSERT(match);
+	ASSERT(streamed.idle());
+	ASSERT_EQ(track.frame(track.frameCount()-1)[1], 800);
+}
+
+UNIT_TEST(bench_trackBaker_scaling, Benchmark)
+{
+	std::vector<uint8_t> ids;
+	for (uint8_t id=1; id<=18; ++id) ids.push_back(id);
+	
+	// Ten minutes at 100Hz, with one thread and one per core
+	HiwonderRpi::TrackBaker::Config config;
+	config.period = std::chrono::milliseconds(10);
+	config.threads = 1;
+	const HiwonderRpi::TrackBaker single(config);
+	config.threads = 0;
+	const HiwonderRpi::TrackBaker multi(config);
+	
+	auto sequential = measure("bake 10min x18 single thread", 5, [&]
+	{
+		Benchmark::keep(single.bake(ids, std::chrono::minutes(10), waveChoreography).frameCount());
+	}, 1, 1);
+	auto result = measure("bake 10min x18 " + std::to_string(multi.threadCount()) + " threads", 5, [&]
+	{
+		Benchmark::keep(multi.bake(ids, std::chrono::minutes(10), waveChoreography).frameCount());
+	}, 1, 1);
+	ASSERT_PERCENTILE_FASTER_THAN(result, 50, std::chrono::seconds(2));
+	
+	// With several cores, the pool must at least gain a third of a core
+	if (multi.threadCount() > 1)
+	{
+		const std::chrono::duration<double,std::nano> budget(sequential.percentile(50)*0.75);
+		ASSERT_PERCENTILE_FASTER_THAN(result, 50, budget);
+	}
+}
+
+UNIT_TEST(busTiming_effect_delay_grows_with_burst_position)
+{
+	HiwonderRpi::BusTiming timing(115200);
+	
+	// 10 bits per byte, 10 bytes per moveTimeWrite frame
+	ASSERT(std::abs(timing.effectDelayUs(0) - 868.06) < 0.1);
+	ASSERT(std::abs(timing.effectDelayUs(17) - 18*868.06) < 1.0);
+	
+	// Round trips of a position read (6+8 bytes = 1215us on the wire) taking 1615us
+	for (int i=0; i<10; ++i) timing.addRoundTrip(1615.3);
+	ASSERT(std::abs(timing.linkLatencyUs() - 200.0) < 1.0);
+	ASSERT(std::abs(timing.effectDelayUs(1) - (2*868.06 + 200.0)) < 1.0);
+}
+
+UNIT_TEST(track_position_interpolates_between_frames)
+{
+	HiwonderRpi::Track track;
+	track.ids = {1, 2};
+	const int16_t frame0[] = {100, 500};
+	const int16_t frame1[] = {200, 400};
+	track.addFrame(0, frame0);
+	track.addFrame(20000, frame1);
+	
+	ASSERT_EQ(track.position(-10.0, 0), 100.0f);
+	ASSERT_EQ(track.position(5000.0, 0), 125.0f);
+	ASSERT_EQ(track.position(15000.0, 1), 425.0f);
+	ASSERT_EQ(track.position(20000.0, 1), 400.0f);
+	ASSERT_EQ(track.position(90000.0, 0), 200.0f);
+}
+
+/// Two buses: a leg with a reversed joint and a wheel, and an arm
+struct ArmDevice
+{
+	constexpr static const char* path = "/dev/ttyAMA1";
+	constexpr static int baudRate = 115200;
+};
+using TestLeg = HiwonderRpi::Bus<HiwonderRpi::DefaultDevice,
+    HiwonderRpi::Joint<1>,
+    HiwonderRpi::Joint<2, HiwonderRpi::JointCommand::Position, -1, 500>,
+    HiwonderRpi::Joint<7, HiwonderRpi::JointCommand::Speed, -1>>;
+using TestArm = HiwonderRpi::Bus<ArmDevice,
+    HiwonderRpi::Joint<3>,
+    HiwonderRpi::Joint<4, HiwonderRpi::JointCommand::Position, 1, 120>>;
+using TestRobot = HiwonderRpi::Robot<TestLeg, TestArm>;
+
+UNIT_TEST(robot_encode_matches_servo_frames)
+{
+	using Servo = HiwonderRpi::HiwonderBusServo;
+	static_assert(TestRobot::jointCount == 5, "joints of all buses");
+	static_assert(TestLeg::FrameBytes == 30, "one frame per joint");
+	
+	// Position requests are built at compile time
+	static_assert(TestLeg::readRequests[1][2] == 2, "request id");
+	static_assert(Servo::encodePosRead(1)[5] == 0xDF, "request checksum");
+	
+	const TestRobot::State state{100, 120, 300, 40, -20};
+	TestRobot::Frames frames;
+	TestRobot::encode(state, 20, frames);
+	
+	// Same bytes as the servo encoders, after direction and offset
+	Servo::Buffer expected;
+	auto matches = [&expected](const uint8_t* frame)
+	{
+		return std::equal(expected.begin(), expected.end(), frame);
+	};
+	Servo::encodeMoveTimeWrite(1, 100, 20, expected.data());
+	ASSERT(matches(std::get<0>(frames).data()));
+	Servo::encodeMoveTimeWrite(2, 380, 20, expected.data());
+	ASSERT(matches(std::get<0>(frames).data()+10));
+	Servo::encodeServoOrMotorModeWrite(7, Servo::Mode::Motor, -300, expected.data());
+	ASSERT(matches(std::get<0>(frames).data()+20));
+	Servo::encodeMoveTimeWrite(3, 40, 20, expected.data());
+	ASSERT(matches(std::get<1>(frames).data()));
+	Servo::encodeMoveTimeWrite(4, 100, 20, expected.data());
+	ASSERT(matches(std::get<1>(frames).data()+10));
+	
+	ASSERT_EQ(TestLeg::ids[2], 7);
+	ASSERT_EQ((HiwonderRpi::Joint<2, HiwonderRpi::JointCommand::Position, -1, 500>::fromServo(380)), 120);
+}
+
+/// Robot of 18 joints on 3 buses, with offsets and mirrored sides
+template <typename Device, uint8_t First>
+using HexapodLeg = HiwonderRpi::Bus<Device,
+    HiwonderRpi::Joint<First, HiwonderRpi::JointCommand::Position, 1, 500>,
+    HiwonderRpi::Joint<First+1, HiwonderRpi::JointCommand::Position, -1, 480>,
+    HiwonderRpi::Joint<First+2, HiwonderRpi::JointCommand::Position, 1, 520>,
+    HiwonderRpi::Joint<First+3, HiwonderRpi::JointCommand::Position, -1, 500>,
+    HiwonderRpi::Joint<First+4, HiwonderRpi::JointCommand::Position, 1, 510>,
+    HiwonderRpi::Joint<First+5, HiwonderRpi::JointCommand::Position, -1, 490>>;
+using Hexapod = HiwonderRpi::Robot<HexapodLeg<HiwonderRpi::DefaultDevice, 1>,
+    HexapodLeg<ArmDevice, 7>, HexapodLeg<HiwonderRpi::DefaultDevice, 13>>;
+
+UNIT_TEST(bench_robot_tick_fixed_vs_per_servo, Benchmark)
+{
+	using Servo = HiwonderRpi::HiwonderBusServo;
+	const int fd = ::open("/dev/null", O_WRONLY);
+	ASSERT(fd >= 0);
+	
+	// Per-servo path, as HiwonderBusServo::moveTimeWrite: the caller maps each
+	//     joint, then every servo encodes its frame and writes it
+	struct JointMapping
+	{
+		uint8_t id;
+		int8_t direction;
+		int16_t offset;
+	};
+	std::vector<JointMapping> joints;
+	for (uint8_t id=1; id<=18; ++id)
+	{
+		const int16_t offsets[] = {500, 480, 520, 500, 510, 490};
+		joints.push_back({id, static_cast<int8_t>((id-1)%2 ? -1 : 1), offsets[(id-1)%6]});
+	}
+	
+	Hexapod::State state;
+	for (size_t i=0; i<state.size(); ++i) state[i] = static_cast<int16_t>(i*7);
+	std::vector<int16_t> values(state.begin(), state.end());
+	Hexapod::Frames frames;
+	
+	auto perServo = measure("robot tick x18 per-servo writes", 200, [&]
+	{
+		static Servo::Buffer buf;
+		for (size_t j=0; j<joints.size(); ++j)
+		{
+			Servo::encodeMoveTimeWrite(joints[j].id,
+			    static_cast<int16_t>(joints[j].offset + joints[j].direction*values[j]), 20, buf.data());
+			Benchmark::keep(::write(fd, buf.data(), buf.size()));
+		}
+	}, 10);
+	auto fixed = measure("robot tick x18 compile-time config", 200, [&]
+	{
+		Hexapod::encode(state, 20, frames);
+		Benchmark::keep(::write(fd, std::get<0>(frames).data(), std::get<0>(frames).size()));
+		Benchmark::keep(::write(fd, std::get<1>(frames).data(), std::get<1>(frames).size()));
+		Benchmark::keep(::write(fd, std::get<2>(frames).data(), std::get<2>(frames).size()));
+	}, 10);
+	::close(fd);
+	
+	// Three writes instead of eighteen: only fails if most of the gain is lost
+	const std::chrono::duration<double,std::nano> budget(perServo.percentile(50)*0.75);
+	ASSERT_PERCENTILE_FASTER_THAN(fixed, 50, budget);
+}
+
+/// Position reply of servo <id>, as sent on the bus
+static std::array<uint8_t, 8> posReply( uint8_t id, int16_t position )
+{
+	std::array<uint8_t, 8> frame{0x55, 0x55, id, 5, 28,
+	    static_cast<uint8_t>(position & 0xFF), static_cast<uint8_t>(position >> 8), 0};
+	frame[7] = HiwonderRpi::HiwonderBusServo::frameChecksum(frame.data());
+	return frame;
+}
+
+UNIT_TEST(robot_read_keeps_speed_joints)
+{
+	// The socket stands for the UART: replies are queued before the requests
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	for (const auto& reply: {posReply(1, 340), posReply(2, 380)})
+	{
+		ASSERT_EQ(::write(fds[1], reply.data(), reply.size()), 8);
+	}
+	
+	// The wheel holds its commanded speed, positions are in joint units
+	int16_t values[] = {0, 0, 300};
+	ASSERT_EQ(TestLeg::read(fds[0], values), 0u);
+	ASSERT_EQ(values[0], 340);
+	ASSERT_EQ(values[1], 120);
+	ASSERT_EQ(values[2], 300);
+	
+	// Only the position joints were requested
+	std::array<uint8_t, 32> requests{};
+	ASSERT_EQ(::read(fds[1], requests.data(), requests.size()), 12);
+	ASSERT(std::equal(TestLeg::readRequests[0].begin(), TestLeg::readRequests[0].end(), requests.begin()));
+	ASSERT(std::equal(TestLeg::readRequests[1].begin(), TestLeg::readRequests[1].end(), requests.begin()+6));
+	::close(fds[0]);
+	::close(fds[1]);
+}
+
+UNIT_TEST(readFrame_reports_corrupted_size)
+{
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	const uint8_t corrupted[] = {0x55, 0x55, 1, 40, 28, 0, 0, 0};
+	ASSERT_EQ(::write(fds[1], corrupted, sizeof(corrupted)), 8);
+	
+	// A size over the frame buffer is corrupted, not a timeout
+	bool corruptedThrown = false;
+	HiwonderRpi::HiwonderBusServo::Buffer frame;
+	try
+	{
+		HiwonderRpi::HiwonderBusServo::readFrame(fds[0], frame);
+	}catch(const HiwonderRpi::HiwonderBusServo::CorruptedFrame&)
+	{
+		corruptedThrown=true;
+	}
+	ASSERT(corruptedThrown);
+	::close(fds[0]);
+	::close(fds[1]);
+}
+
+UNIT_TEST(bench_protocol_encode, Benchmark)
+{
+	using Servo = HiwonderRpi::HiwonderBusServo;
+	Servo::Buffer frame;
+	uint8_t id = 1;
+	int16_t position = 0;
+	
+	// One moveTimeWrite and one position request, checksums included
+	auto result = measure("protocol encode moveTimeWrite+posRead", 200, [&]
+	{
+		id = static_cast<uint8_t>(id%18 + 1);
+		position = static_cast<int16_t>((position + 7)%1000);
+		Servo::encodeMoveTimeWrite(id, position, 20, frame.data());
+		Benchmark::keep(frame);
+		Benchmark::keep(Servo::encodePosRead(id));
+	}, 100);
+	ASSERT_PERCENTILE_FASTER_THAN(result, 99, std::chrono::microseconds(1));
+}
+
+UNIT_TEST(bench_protocol_readFrame, Benchmark)
+{
+	using Servo = HiwonderRpi::HiwonderBusServo;
+	int fds[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	const auto reply = posReply(3, 512);
+	Servo::Buffer frame;
+	int16_t position = 0;
+	
+	// Host side of a position read: parse and check the reply (8 bytes take ~700us on the wire)
+	auto result = measure("protocol readFrame+decode posRead reply", 200, [&]
+	{
+		Benchmark::keep(::write(fds[1], reply.data(), reply.size()));
+		Servo::readFrame(fds[0], frame);
+		Benchmark::keep(Servo::decodePosReply(3, frame, position));
+	});
+	::close(fds[0]);
+	::close(fds[1]);
+	ASSERT_EQ(position, 512);
+	ASSERT_PERCENTILE_FASTER_THAN(result, 99, std::chrono::microseconds(100));
+}